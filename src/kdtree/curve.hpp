@@ -0,0 +1,117 @@
+
+#ifndef CURVE_HPP
+#define CURVE_HPP
+
+#include <array>
+#include <algorithm>
+#include <cstdint>
+
+#include "Vec.hpp"
+#include "hyperbox.hpp"
+
+namespace iui {
+
+	/*
+	 * space-filling curves through a bounding box; points that are close along the curve are close in space.
+	 * a Morton (Z-order) key interleaves the coordinates' bits, a Hilbert key additionally rotates and mirrors
+	 * every quadrant so that the curve never jumps, which keeps neighbours closer at a slightly higher cost per key
+	 */
+	enum class SpaceFillingCurve {
+		None,
+		Morton,
+		Hilbert
+	};
+
+	namespace detail {
+
+		/*
+		 * maps points to 64-bit keys along a space-filling curve through `frame`.
+		 * the key covers up to 64 axes with 64 / (number of axes) bits each, at most 32; axes beyond the 64th
+		 * are ignored, which for PCA-reduced points drops the ones with the least variance
+		 */
+		template<typename TCoord, int NDims>
+		class CurveEncoder {
+		public:
+			static constexpr int NumKeyAxes = std::min(NDims, 64);
+			static constexpr int BitsPerAxis = std::min(64 / NumKeyAxes, 32);
+
+			CurveEncoder() = default;
+
+			CurveEncoder(SpaceFillingCurve curve, const Hyperbox<TCoord, NDims>& frame) : curve_(curve) {
+				static constexpr double NumCells = double(uint64_t(1) << BitsPerAxis);
+				for(int axis=0; axis<NumKeyAxes; axis++) {
+					lower_[axis] = frame.pos0[axis];
+					double extent = double(frame.pos1[axis]) - double(frame.pos0[axis]);
+					scale_[axis] = extent > 0.0 ? NumCells / extent : 0.0;
+				}
+			}
+
+			[[nodiscard]] uint64_t key(const Vec<TCoord, NDims>& point) const {
+				static constexpr double MaxCell = double((uint64_t(1) << BitsPerAxis) - 1);
+				std::array<uint32_t, NumKeyAxes> cells;
+				for(int axis=0; axis<NumKeyAxes; axis++) {
+					double cell = (double(point[axis]) - lower_[axis]) * scale_[axis];
+					cells[axis] = uint32_t(std::clamp(cell, 0.0, MaxCell));
+				}
+				if(curve_ == SpaceFillingCurve::Hilbert) {
+					hilbertTranspose(cells);
+				}
+				return interleave(cells);
+			}
+
+		private:
+			/*
+			 * the most significant bit of every axis first, then the next one, and so on
+			 */
+			[[nodiscard]] static uint64_t interleave(const std::array<uint32_t, NumKeyAxes>& cells) {
+				uint64_t key = 0;
+				for(int bit=BitsPerAxis-1; bit>=0; bit--) {
+					for(int axis=0; axis<NumKeyAxes; axis++) {
+						key = (key << 1) | ((cells[axis] >> bit) & 1);
+					}
+				}
+				return key;
+			}
+
+			/*
+			 * turns cell coordinates into the "transposed" Hilbert index, whose interleaved bits are the
+			 * position along the curve (J. Skilling, Programming the Hilbert curve, AIP Conf. Proc. 707, 2004)
+			 */
+			static void hilbertTranspose(std::array<uint32_t, NumKeyAxes>& x) {
+				const uint32_t highBit = uint32_t(1) << (BitsPerAxis - 1);
+				for(uint32_t q = highBit; q > 1; q >>= 1) {
+					uint32_t lowerBits = q - 1;
+					for(int axis=0; axis<NumKeyAxes; axis++) {
+						if(x[axis] & q) {
+							x[0] ^= lowerBits;
+						} else {
+							uint32_t swapped = (x[0] ^ x[axis]) & lowerBits;
+							x[0] ^= swapped;
+							x[axis] ^= swapped;
+						}
+					}
+				}
+				for(int axis=1; axis<NumKeyAxes; axis++) {
+					x[axis] ^= x[axis - 1];
+				}
+				uint32_t flip = 0;
+				for(uint32_t q = highBit; q > 1; q >>= 1) {
+					if(x[NumKeyAxes - 1] & q) {
+						flip ^= q - 1;
+					}
+				}
+				for(int axis=0; axis<NumKeyAxes; axis++) {
+					x[axis] ^= flip;
+				}
+			}
+
+			SpaceFillingCurve curve_ = SpaceFillingCurve::None;
+			std::array<double, NumKeyAxes> lower_ {};
+			std::array<double, NumKeyAxes> scale_ {};
+		};
+
+	}
+
+}
+
+#endif //CURVE_HPP
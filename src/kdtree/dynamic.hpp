@@ -0,0 +1,220 @@
+
+#ifndef DYNAMIC_HPP
+#define DYNAMIC_HPP
+
+#include "kdtree.hpp"
+
+#include <vector>
+#include <optional>
+
+namespace iui {
+
+	/*
+	 * a k-d tree that supports inserting and erasing entries, built with the logarithmic method:
+	 * new entries go to a small buffer that is scanned linearly, and a full buffer is merged
+	 * into a set of static KDTrees of geometrically growing sizes, like carrying in a binary counter.
+	 * erased entries are marked as deleted and dropped when their tree gets rebuilt;
+	 * a tree that is more than half deleted is rebuilt right away.
+	 */
+	template<typename TLabel, int NDims, typename TCoord = double>
+	class DynamicKDTree {
+	public:
+		using StaticTreeType = KDTree<TLabel, NDims, TCoord>;
+		using IndexType = typename StaticTreeType::IndexType;
+		using ElementType = TLabel;
+		using HyperboxType = typename StaticTreeType::HyperboxType;
+		using EntryType = typename StaticTreeType::EntryType;
+
+		static constexpr size_t BufferCapacity = std::max<size_t>(64, 8 * StaticTreeType::MaxLeafElements);
+
+		template<std::ranges::sized_range TRange>
+			requires (std::is_convertible_v<std::ranges::range_value_t<TRange>, EntryType>)
+		explicit DynamicKDTree(TRange&& items, detail::KDTreeFromRangeTagT = {}, const KDTreeBuildOptions& options = {})
+			: options_(options)
+		{
+			auto entries = RangeToVector(items);
+			if(entries.size() < BufferCapacity) {
+				buffer_ = std::move(entries);
+				return;
+			}
+			size_t level = 0;
+			while(levelCapacity(level) < entries.size()) {
+				level++;
+			}
+			levels_.resize(level + 1);
+			buildLevel(level, entries);
+		}
+
+		template<std::ranges::sized_range TRange>
+			requires detail::AggregateEntryInitType<std::remove_cvref_t<std::ranges::range_value_t<TRange>>>
+		explicit DynamicKDTree(TRange&& items, const KDTreeBuildOptions& options = {}) : DynamicKDTree(std::views::transform(items, [](auto&& item) {
+			const auto& [position, value] = item;
+			return EntryType {position, value};
+		}), detail::KDTreeFromRangeTagT {}, options) {}
+
+		void insert(const EntryType& entry) {
+			buffer_.push_back(entry);
+			if(buffer_.size() < BufferCapacity) {
+				return;
+			}
+
+			std::vector<EntryType> carry = std::move(buffer_);
+			buffer_.clear();
+			for(size_t level = 0; ; level++) {
+				if(level == levels_.size()) {
+					levels_.emplace_back();
+				}
+				if(not levels_[level].tree) {
+					buildLevel(level, carry);
+					return;
+				}
+				appendLiveEntries(levels_[level], carry);
+				levels_[level] = {};
+			}
+		}
+
+		/*
+		 * erases one entry with the given coordinates and label; returns false if there is none
+		 */
+		bool erase(const EntryType& entry) {
+			auto inBuffer = std::ranges::find_if(buffer_, [&](const EntryType& e) {
+				return e.coord == entry.coord && e.label == entry.label;
+			});
+			if(inBuffer != buffer_.end()) {
+				*inBuffer = buffer_.back();
+				buffer_.pop_back();
+				return true;
+			}
+
+			for(size_t level = 0; level < levels_.size(); level++) {
+				auto& lvl = levels_[level];
+				if(not lvl.tree) {
+					continue;
+				}
+				std::optional<size_t> found;
+				const EntryType* base = lvl.tree->entries().data();
+				lvl.tree->walk(
+					[&](const EntryType& e) {
+						size_t index = &e - base;
+						if(not found && not lvl.deleted[index] && e.coord == entry.coord && e.label == entry.label) {
+							found = index;
+						}
+					},
+					[&](const HyperboxType& hbox) {
+						return not found && hbox.contains(entry.coord);
+					}
+				);
+				if(found) {
+					lvl.deleted[*found] = true;
+					lvl.numDeleted++;
+					if(2 * lvl.numDeleted > lvl.tree->numEntries()) {
+						std::vector<EntryType> live;
+						appendLiveEntries(lvl, live);
+						lvl = {};
+						if(not live.empty()) {
+							buildLevel(level, live);
+						}
+					}
+					return true;
+				}
+			}
+			return false;
+		}
+
+		[[nodiscard]] size_t numEntries() const {
+			size_t result = buffer_.size();
+			for(const auto& lvl: levels_) {
+				if(lvl.tree) {
+					result += lvl.tree->numEntries() - lvl.numDeleted;
+				}
+			}
+			return result;
+		}
+
+		[[nodiscard]] size_t numTrees() const {
+			return std::ranges::count_if(levels_, [](const Level& lvl) {
+				return lvl.tree.has_value();
+			});
+		}
+
+		template<std::invocable<EntryType> FnT, std::invocable<HyperboxType> PredFnT>
+		void walk(FnT&& fn, PredFnT&& hboxPredicate) const {
+			for(const auto& entry: buffer_) {
+				fn(entry);
+			}
+			for(const auto& lvl: levels_ | std::views::reverse) {
+				if(lvl.tree) {
+					lvl.tree->walk(liveOnly(lvl, fn), hboxPredicate);
+				}
+			}
+		}
+
+		/*
+		 * walks the largest trees first, since they are the most likely to tighten the predicate's radius early
+		 */
+		template<std::invocable<EntryType> FnT, std::invocable<HyperboxType> PredFnT>
+		void walkNearestFirst(const IndexType& point, FnT&& fn, PredFnT&& hboxPredicate) const {
+			for(const auto& lvl: levels_ | std::views::reverse) {
+				if(lvl.tree) {
+					lvl.tree->walkNearestFirst(point, liveOnly(lvl, fn), hboxPredicate);
+				}
+			}
+			for(const auto& entry: buffer_) {
+				fn(entry);
+			}
+		}
+
+	private:
+		struct Level {
+			std::optional<StaticTreeType> tree;
+			std::vector<bool> deleted;
+			size_t numDeleted = 0;
+		};
+
+		static size_t levelCapacity(size_t level) {
+			return BufferCapacity << level;
+		}
+
+		template<typename FnT>
+		static auto liveOnly(const Level& lvl, FnT& fn) {
+			const EntryType* base = lvl.tree->entries().data();
+			return [&lvl, &fn, base](const EntryType& entry) {
+				if(not lvl.deleted[&entry - base]) {
+					fn(entry);
+				}
+			};
+		}
+
+		static void appendLiveEntries(const Level& lvl, std::vector<EntryType>& out) {
+			auto entries = lvl.tree->entries();
+			for(size_t i=0; i<entries.size(); i++) {
+				if(not lvl.deleted[i]) {
+					out.push_back(entries[i]);
+				}
+			}
+		}
+
+		void buildLevel(size_t level, std::vector<EntryType>& entries) {
+			KDTreeBuildOptions options = options_;
+			/* erasing relies on one entry per insertion */
+			options.collapseDuplicates = false;
+			if(options.seed) {
+				options.seed = detail::splitMix64(*options.seed + numBuilds_);
+			}
+			numBuilds_++;
+
+			auto& lvl = levels_[level];
+			lvl.tree.emplace(entries, detail::KDTreeFromRangeTagT {}, options);
+			lvl.deleted.assign(lvl.tree->numEntries(), false);
+			lvl.numDeleted = 0;
+		}
+
+		KDTreeBuildOptions options_;
+		std::vector<EntryType> buffer_;
+		std::vector<Level> levels_;
+		uint64_t numBuilds_ = 0;
+	};
+
+}
+
+#endif //DYNAMIC_HPP
@@ -0,0 +1,212 @@
+
+#ifndef FOREST_HPP
+#define FOREST_HPP
+
+#include "kdtree.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+namespace iui {
+
+	/*
+	 * a set of KDTrees over the same entries, each split along randomly picked high-variance axes
+	 * (see KDTreeBuildOptions::randomizedSplitAxes). the trees are searched together through a single
+	 * priority queue of unexplored branches, so that a fixed budget of leaves goes to the most promising
+	 * branches of all trees instead of being spent on one tree's poor splits; this is what keeps
+	 * searches tractable at hundreds of dimensions.
+	 * each tree stores the coordinates of every entry together with the entry's index; labels are stored once.
+	 */
+	template<typename TLabel, int NDims, typename TCoord = double>
+	class KDForest {
+	public:
+		using TreeType = KDTree<uint32_t, NDims, TCoord>;
+		using IndexType = typename TreeType::IndexType;
+		using ElementType = TLabel;
+		using HyperboxType = typename TreeType::HyperboxType;
+		using EntryType = typename KDTree<TLabel, NDims, TCoord>::EntryType;
+		using MemoryStats = typename TreeType::MemoryStats;
+
+		static constexpr int DefaultRandomizedSplitAxes = 5;
+
+		/*
+		 * per-query state of walkLeavesPrioritized(), reused between queries
+		 */
+		class QueryScratch {
+		private:
+			friend class KDForest;
+
+			struct Branch {
+				double priority;
+				double lowerBound;
+				uint32_t treeIndex;
+				uint32_t nodeIndex;
+
+				friend bool operator>(const Branch& lhs, const Branch& rhs) {
+					return lhs.priority > rhs.priority;
+				}
+			};
+
+			std::vector<Branch> branches;
+			std::vector<uint32_t> visitedEpoch;
+			uint32_t epoch = 0;
+		};
+
+		template<std::ranges::sized_range TRange>
+			requires (std::is_convertible_v<std::ranges::range_value_t<TRange>, EntryType>)
+		explicit KDForest(TRange&& items, detail::KDTreeFromRangeTagT = {}, const KDTreeBuildOptions& options = {}) {
+			std::vector<typename TreeType::EntryType> indexedEntries;
+			for(const EntryType& entry: items) {
+				indexedEntries.push_back({entry.coord, uint32_t(labels_.size())});
+				labels_.push_back(entry.label);
+			}
+
+			KDTreeBuildOptions treeOptions = options;
+			/* every entry has a label of its own here */
+			treeOptions.collapseDuplicates = false;
+			/* the shared walk reads neither node bounds nor SoA leaves, and answers queries in their own order */
+			treeOptions.nodeBounds = NodeBounds::Cells;
+			treeOptions.leafLayout = LeafLayout::ArrayOfStructs;
+			treeOptions.entryOrder = SpaceFillingCurve::None;
+			if(treeOptions.randomizedSplitAxes <= 0) {
+				treeOptions.randomizedSplitAxes = DefaultRandomizedSplitAxes;
+			}
+			uint64_t seed = options.seed.value_or(std::random_device{}());
+			for(int i=0; i<std::max(1, options.numForestTrees); i++) {
+				treeOptions.seed = detail::splitMix64(seed + i);
+				trees_.emplace_back(indexedEntries, detail::KDTreeFromRangeTagT {}, treeOptions);
+			}
+		}
+
+		template<std::ranges::sized_range TRange>
+			requires detail::AggregateEntryInitType<std::remove_cvref_t<std::ranges::range_value_t<TRange>>>
+		explicit KDForest(TRange&& items, const KDTreeBuildOptions& options = {}) : KDForest(std::views::transform(items, [](auto&& item) {
+			const auto& [position, value] = item;
+			return EntryType {position, value};
+		}), detail::KDTreeFromRangeTagT {}, options) {}
+
+		[[nodiscard]] size_t numEntries() const {
+			return labels_.size();
+		}
+
+		[[nodiscard]] size_t numTrees() const {
+			return trees_.size();
+		}
+
+		[[nodiscard]] const TreeType& tree(size_t index) const {
+			return trees_[index];
+		}
+
+		[[nodiscard]] MemoryStats memoryStats() const {
+			MemoryStats result {};
+			for(const auto& tree: trees_) {
+				auto stats = tree.memoryStats();
+				result.numNodes += stats.numNodes;
+				result.bytesPerNode = stats.bytesPerNode;
+				result.bytesPerNodePointerBased = stats.bytesPerNodePointerBased;
+				result.nodeBytes += stats.nodeBytes;
+				result.entryBytes += stats.entryBytes;
+				result.soaBytes += stats.soaBytes;
+				result.boundsBytes += stats.boundsBytes;
+			}
+			result.entryBytes += labels_.size() * sizeof(TLabel);
+			return result;
+		}
+
+		/*
+		 * exact traversals; they only use the first tree
+		 */
+		template<std::invocable<EntryType> FnT, std::invocable<HyperboxType> PredFnT>
+		void walk(FnT&& fn, PredFnT&& hboxPredicate) const {
+			trees_[0].walk(withLabels(fn), hboxPredicate);
+		}
+
+		template<std::invocable<EntryType> FnT, std::invocable<HyperboxType> PredFnT>
+		void walkNearestFirst(const IndexType& point, FnT&& fn, PredFnT&& hboxPredicate) const {
+			trees_[0].walkNearestFirst(point, withLabels(fn), hboxPredicate);
+		}
+
+		/*
+		 * best-bin-first search over all trees at once. every tree is descended to the leaf containing `point`
+		 * first; the branches passed on the way are queued and explored cheapest first, where a branch costs
+		 * the sum of squared distances from `point` to the splitting planes on its path.
+		 * `fn(coord, label)` is called once per entry, even if several trees reach it.
+		 * `lowerBoundPredicate(lowerBound, leavesVisited)` decides whether to enter a branch; `lowerBound`
+		 * is the largest per-axis distance from `point` to the branch's cell, which no Minkowski distance
+		 * can undercut. returns the number of leaves visited.
+		 */
+		template<std::invocable<const IndexType&, const TLabel&> FnT, std::predicate<double, int64_t> PredFnT>
+		int64_t walkLeavesPrioritized(const IndexType& point, QueryScratch& scratch, FnT&& fn, PredFnT&& lowerBoundPredicate) const {
+			if(scratch.visitedEpoch.size() != labels_.size() || scratch.epoch == std::numeric_limits<uint32_t>::max()) {
+				scratch.visitedEpoch.assign(labels_.size(), 0);
+				scratch.epoch = 0;
+			}
+			scratch.epoch++;
+
+			auto& branches = scratch.branches;
+			branches.clear();
+			int64_t leavesVisited = 0;
+
+			auto descend = [&](typename QueryScratch::Branch branch) {
+				const auto& tree = trees_[branch.treeIndex];
+				auto nodes = tree.nodes();
+				const auto* node = &nodes[branch.nodeIndex];
+				while(not node->isLeaf()) {
+					double diff = double(point[node->axisOrTag]) - double(node->splitValue);
+					uint32_t nearIndex = node - nodes.data() + 1;
+					uint32_t farIndex = node->rchildOrLastEntry;
+					if(diff >= 0) {
+						std::swap(nearIndex, farIndex);
+					}
+					typename QueryScratch::Branch far {
+						.priority = branch.priority + diff * diff,
+						.lowerBound = std::max(branch.lowerBound, std::fabs(diff)),
+						.treeIndex = branch.treeIndex,
+						.nodeIndex = farIndex
+					};
+					if(lowerBoundPredicate(far.lowerBound, leavesVisited)) {
+						branches.push_back(far);
+						std::ranges::push_heap(branches, std::greater<> {});
+					}
+					node = &nodes[nearIndex];
+				}
+
+				leavesVisited++;
+				for(const auto& entry: tree.leafEntries(*node)) {
+					if(scratch.visitedEpoch[entry.label] != scratch.epoch) {
+						scratch.visitedEpoch[entry.label] = scratch.epoch;
+						fn(entry.coord, labels_[entry.label]);
+					}
+				}
+			};
+
+			for(uint32_t i=0; i<trees_.size(); i++) {
+				descend({.priority = 0.0, .lowerBound = 0.0, .treeIndex = i, .nodeIndex = 0});
+			}
+			while(not branches.empty()) {
+				std::ranges::pop_heap(branches, std::greater<> {});
+				auto branch = branches.back();
+				branches.pop_back();
+				if(lowerBoundPredicate(branch.lowerBound, leavesVisited)) {
+					descend(branch);
+				}
+			}
+			return leavesVisited;
+		}
+
+	private:
+		template<typename FnT>
+		auto withLabels(FnT& fn) const {
+			return [this, &fn](const typename TreeType::EntryType& entry) {
+				fn(EntryType {entry.coord, labels_[entry.label]});
+			};
+		}
+
+		std::vector<TLabel> labels_;
+		std::vector<TreeType> trees_;
+	};
+
+}
+
+#endif //FOREST_HPP
@@ -81,7 +81,7 @@ namespace iui {
 		[[nodiscard]] static Hyperbox of(TRange&& items) {
 			PointType pos0, pos1;
 			pos0.fill(std::numeric_limits<TCoord>::max());
-			pos1.fill(std::numeric_limits<TCoord>::min());
+			pos1.fill(std::numeric_limits<TCoord>::lowest());
 			for(const auto& item: items) {
 				for(int i=0; i<NDims; i++) {
 					pos0[i] = std::min(pos0[i], item[i]);
@@ -5,13 +5,24 @@
 #include <array>
 #include <ranges>
 #include <algorithm>
-#include <deque>
+#include <cstdint>
+#include <variant>
+#include <vector>
+#include <span>
+#include <optional>
+#include <stdexcept>
 #include <random>
 #include <format>
 #include <memory>
+#include <numeric>
+#include <cmath>
 
 #include "Vec.hpp"
 #include "hyperbox.hpp"
+#include "split.hpp"
+#include "curve.hpp"
+#include "threadpool.hpp"
+#include "serialization.hpp"
 
 namespace iui {
 
@@ -29,14 +40,156 @@ namespace iui {
 			&& std::is_class_v<std::remove_cvref_t<T>>;
 
 		struct KDTreeFromRangeTagT{};
+		struct KDTreeFromFileTagT{};
+
+		template<typename T, size_t Alignment>
+		struct AlignedAllocator {
+			using value_type = T;
+
+			template<typename U>
+			struct rebind {
+				using other = AlignedAllocator<U, Alignment>;
+			};
+
+			AlignedAllocator() = default;
+			template<typename U>
+			AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+			T* allocate(size_t n) {
+				return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t {Alignment}));
+			}
+
+			void deallocate(T* ptr, size_t) {
+				::operator delete(ptr, std::align_val_t {Alignment});
+			}
+
+			friend bool operator==(const AlignedAllocator&, const AlignedAllocator&) {
+				return true;
+			}
+		};
+
+		inline uint64_t splitMix64(uint64_t x) {
+			x += 0x9E3779B97F4A7C15ull;
+			x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+			x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+			return x ^ (x >> 31);
+		}
+
+		/*
+		 * same result as std::stable_partition, but the counting and scattering passes
+		 * are split into chunks that run on the pool
+		 */
+		template<typename T, typename PredFnT>
+		auto parallelStablePartition(std::span<T> items, PredFnT&& pred, ThreadPool& pool) {
+			size_t chunkSize = std::max<size_t>(1024, items.size() / (4 * pool.numThreads()) + 1);
+			size_t numChunks = (items.size() + chunkSize - 1) / chunkSize;
+
+			std::vector<size_t> numTrue(numChunks);
+			pool.parallelFor(items.size(), chunkSize, [&](size_t begin, size_t end) {
+				numTrue[begin / chunkSize] = std::count_if(items.begin() + begin, items.begin() + end, pred);
+			});
+
+			std::vector<size_t> trueOffset(numChunks), falseOffset(numChunks);
+			size_t totalTrue = 0, totalFalse = 0;
+			for(size_t i=0; i<numChunks; i++) {
+				size_t chunkLength = std::min(items.size(), (i + 1) * chunkSize) - i * chunkSize;
+				trueOffset[i] = totalTrue;
+				falseOffset[i] = totalFalse;
+				totalTrue += numTrue[i];
+				totalFalse += chunkLength - numTrue[i];
+			}
+
+			std::vector<T> source(items.begin(), items.end());
+			pool.parallelFor(items.size(), chunkSize, [&](size_t begin, size_t end) {
+				size_t chunk = begin / chunkSize;
+				auto trueOut = items.begin() + trueOffset[chunk];
+				auto falseOut = items.begin() + totalTrue + falseOffset[chunk];
+				for(size_t i=begin; i<end; i++) {
+					if(pred(source[i])) {
+						*trueOut++ = source[i];
+					} else {
+						*falseOut++ = source[i];
+					}
+				}
+			});
+
+			return items.begin() + totalTrue;
+		}
+
+		/*
+		 * the node layout KDTree used before switching to a flat array
+		 * (parent pointer + variant of a leaf span and a split with two child pointers);
+		 * kept only to report how much memory the flat layout saves
+		 */
+		template<typename TEntry, typename TSplit>
+		struct PointerBasedNode {
+			struct InnerNode {
+				TSplit split;
+				PointerBasedNode* lchild;
+				PointerBasedNode* rchild;
+			};
+
+			PointerBasedNode* parent;
+			std::variant<std::span<const TEntry>, InnerNode> data;
+		};
+	};
+
+	enum class LeafLayout {
+		ArrayOfStructs,
+		StructureOfArrays
+	};
+
+	/*
+	 * what a KDTree's walks test for pruning: the cells cut out by the split planes, or the bounding boxes
+	 * of the entries below each node, which are often much smaller after skewed splits. the boxes are stored
+	 * per node, either as they are or quantized to one byte per coordinate relative to the parent's box;
+	 * quantized boxes are rounded outwards, so pruning stays exact
+	 */
+	enum class NodeBounds {
+		Cells,
+		Tight,
+		QuantizedTight
 	};
 
-	enum class BalancingPolicy {
-		Exact,
-		Approximate
+	struct KDTreeBuildOptions {
+		std::optional<uint64_t> seed = std::nullopt;
+		/* KDForest ignores these two */
+		LeafLayout leafLayout = LeafLayout::ArrayOfStructs;
+		NodeBounds nodeBounds = NodeBounds::Cells;
+		/* defaults to KDTree::MaxLeafElements for AoS leaves and KDTree::SoAMaxLeafElements for SoA leaves */
+		std::optional<size_t> maxLeafElements = std::nullopt;
+		/*
+		 * stores entries with identical coordinates and labels once, weighted by how often they occur
+		 * (see KDTree::entryWeight()). needs ordered labels; KDForest and DynamicKDTree ignore this
+		 */
+		bool collapseDuplicates = false;
+		/*
+		 * sorts the entries along this curve before building and within every leaf afterwards, so that entries
+		 * close in space are close in memory; predictBatch() then also answers queries in this order.
+		 * KDForest ignores this
+		 */
+		SpaceFillingCurve entryOrder = SpaceFillingCurve::None;
+		/*
+		 * if positive, every inner node splits at the mean of one of this many highest-variance axes,
+		 * picked at random, as in randomized k-d forests
+		 */
+		int randomizedSplitAxes = 0;
+		/* how many trees a KDForest builds */
+		int numForestTrees = 4;
+		/*
+		 * trees built from the same entries with the same seed and cutoffs are identical,
+		 * regardless of the number of threads
+		 */
+		int numThreads = 1;
+		size_t parallelSubtreeCutoff = 4096;
+		size_t parallelPartitionCutoff = 65536;
 	};
 
-	template<typename TLabel, int NDims, typename TCoord = double>
+	/*
+	 * `TSplitPolicy` is a BalancingPolicy (see split.hpp) that picks the split of every inner node,
+	 * unless KDTreeBuildOptions::randomizedSplitAxes is set
+	 */
+	template<typename TLabel, int NDims, typename TCoord = double, typename TSplitPolicy = ApproximateMedianSplit>
 	class KDTree {
 	public:
 
@@ -52,42 +205,242 @@ namespace iui {
 			ElementType label;
 		};
 
+		static_assert(BalancingPolicy<TSplitPolicy, EntryType, HyperboxType>);
 
+
+		/*
+		 * nodes live in one contiguous array in depth-first order. an inner node's left child
+		 * immediately follows it, so only the index of the right child has to be stored.
+		 * leaves refer to a range of entries instead.
+		 */
 		struct Node {
-			struct InnerNode {
-				HyperboxSplitType split;
-				Node* lchild;
-				Node* rchild;
+			static constexpr uint32_t LeafTag = 0xFFFF'FFFFu;
+
+			union {
+				TCoord splitValue;
+				uint32_t firstEntry;
 			};
+			uint32_t axisOrTag;
+			uint32_t rchildOrLastEntry;
+
+			[[nodiscard]] bool isLeaf() const {
+				return axisOrTag == LeafTag;
+			}
+
+			[[nodiscard]] HyperboxSplitType split() const {
+				return {.axis = int(axisOrTag), .value = splitValue};
+			}
+		};
 
-			Node* parent;
-			std::variant<std::span<const EntryType>, InnerNode> data;
+		/*
+		 * a leaf's entries as stored with LeafLayout::StructureOfArrays:
+		 * coordinate `axis` of entry `i` is at coords[axis * axisStride + i].
+		 * `weights` is null unless the tree collapsed duplicates
+		 */
+		struct SoALeaf {
+			const TCoord* coords;
+			size_t axisStride;
+			const TLabel* labels;
+			const uint32_t* weights;
+			size_t size;
 		};
 
-		using InnerNodeType = typename Node::InnerNode;
+		/*
+		 * a node's bounding box with NodeBounds::QuantizedTight, in 255ths of the parent's (decoded) box:
+		 * `lower` counts steps up from the parent's lower corner and `upper` counts steps down from its upper corner
+		 */
+		struct QuantizedBounds {
+			std::array<uint8_t, NDims> lower;
+			std::array<uint8_t, NDims> upper;
+		};
+
+		struct MemoryStats {
+			size_t numNodes;
+			size_t bytesPerNode;
+			size_t bytesPerNodePointerBased;
+			size_t nodeBytes;
+			size_t entryBytes;
+			size_t soaBytes;
+			size_t boundsBytes;
+		};
 
 		static constexpr size_t MaxDepth = 64;
 		static constexpr size_t MaxLeafElements = std::max<size_t>(2, 2 * CacheLineSize / sizeof(IndexType));
+		static constexpr size_t SoAMaxLeafElements = std::max<size_t>(MaxLeafElements, 32);
 
 
 		template<std::ranges::sized_range TRange>
 			requires (std::is_convertible_v<std::ranges::range_value_t<TRange>, EntryType>)
-		explicit KDTree(TRange&& items, detail::KDTreeFromRangeTagT _ = {}) {
+		explicit KDTree(TRange&& items, detail::KDTreeFromRangeTagT _ = {}, const KDTreeBuildOptions& options = {})
+			: options_(options)
+		{
 			entries_ = RangeToVector(items);
 			rootHyperbox_ = HyperboxType::of(entries_ | std::views::transform([](const EntryType& e){return e.coord;}));
-			rootNode_ = createNode(entries_, nullptr);
-			//printf("tree has %d kB\n", (sizeof(Node) * nodes_.size()) / 1024);
+			if(entries_.size() >= Node::LeafTag) {
+				throw std::length_error(std::format("a k-d tree cannot hold {} entries", entries_.size()));
+			}
+
+			std::optional<CollapsedEntries> collapsed;
+			if(options.collapseDuplicates) {
+				collapsed = collapseDuplicateEntries();
+			}
+			entryOrder_ = options.entryOrder;
+			if(entryOrder_ != SpaceFillingCurve::None) {
+				sortByCurve(entries_);
+			}
+
+			maxLeafElements_ = options.maxLeafElements.value_or(
+				options.leafLayout == LeafLayout::StructureOfArrays ? SoAMaxLeafElements : MaxLeafElements
+			);
+
+			uint64_t seed = options.seed.value_or(std::random_device{}());
+			if(options.numThreads > 1) {
+				ThreadPool pool(options.numThreads);
+				createNode(entries_, rootHyperbox_, 0, seed, nodes_, &pool);
+			} else {
+				createNode(entries_, rootHyperbox_, 0, seed, nodes_, nullptr);
+			}
+			nodes_.shrink_to_fit();
+
+			if(entryOrder_ != SpaceFillingCurve::None) {
+				for(const Node& node: nodes_) {
+					if(node.isLeaf()) {
+						sortByCurve(std::span(entries_).subspan(node.firstEntry, node.rchildOrLastEntry - node.firstEntry));
+					}
+				}
+			}
+			if(collapsed) {
+				attachWeights(*collapsed);
+			}
+			if(options.nodeBounds != NodeBounds::Cells) {
+				buildNodeBounds(options.nodeBounds);
+			}
+			if(options.leafLayout == LeafLayout::StructureOfArrays) {
+				buildSoALeaves();
+			}
+			updateViews();
 		}
 
 		template<std::ranges::sized_range TRange>
 			requires detail::AggregateEntryInitType<std::remove_cvref_t<std::ranges::range_value_t<TRange>>>
-		explicit KDTree(TRange&& items) : KDTree(std::views::transform(items, [](auto&& item) {
+		explicit KDTree(TRange&& items, const KDTreeBuildOptions& options = {}) : KDTree(std::views::transform(items, [](auto&& item) {
 			const auto& [position, value] = item;
 			return EntryType {position, value};
-		}), detail::KDTreeFromRangeTagT {}) {}
+		}), detail::KDTreeFromRangeTagT {}, options) {}
 
 		[[nodiscard]] const Node* rootNode() const {
-			return rootNode_;
+			return &nodesView_[0];
+		}
+
+		[[nodiscard]] std::span<const Node> nodes() const {
+			return nodesView_;
+		}
+
+		[[nodiscard]] std::span<const EntryType> entries() const {
+			return entriesView_;
+		}
+
+		[[nodiscard]] std::span<const EntryType> leafEntries(const Node& leaf) const {
+			return entriesView_.subspan(leaf.firstEntry, leaf.rchildOrLastEntry - leaf.firstEntry);
+		}
+
+		[[nodiscard]] bool hasSoALeaves() const {
+			return not soaLabelsView_.empty();
+		}
+
+		[[nodiscard]] SoALeaf soaLeaf(const Node& leaf) const {
+			return SoALeaf {
+				.coords = soaCoordsView_.data() + leaf.firstEntry,
+				.axisStride = soaAxisStride_,
+				.labels = soaLabelsView_.data() + leaf.firstEntry,
+				.weights = weightsView_.empty() ? nullptr : weightsView_.data() + leaf.firstEntry,
+				.size = leaf.rchildOrLastEntry - leaf.firstEntry
+			};
+		}
+
+		/*
+		 * how many of the tree's input entries `entry` stands for; `entry` must come from entries() or leafEntries()
+		 */
+		[[nodiscard]] uint32_t entryWeight(const EntryType& entry) const {
+			return weightsView_.empty() ? 1 : weightsView_[&entry - entriesView_.data()];
+		}
+
+		/*
+		 * the entries' weights in the order of entries(), or nothing if no entries were collapsed
+		 */
+		[[nodiscard]] std::span<const uint32_t> weights() const {
+			return weightsView_;
+		}
+
+		/*
+		 * the number of input entries, counting collapsed duplicates
+		 */
+		[[nodiscard]] size_t totalWeight() const {
+			if(weightsView_.empty()) {
+				return entriesView_.size();
+			}
+			return std::accumulate(weightsView_.begin(), weightsView_.end(), size_t {0});
+		}
+
+		[[nodiscard]] SpaceFillingCurve entryOrder() const {
+			return entryOrder_;
+		}
+
+		/*
+		 * the position of `point` along `curve` through the tree's bounding box
+		 */
+		[[nodiscard]] uint64_t curveKey(const IndexType& point, SpaceFillingCurve curve) const {
+			return detail::CurveEncoder<TCoord, NDims>(curve, rootHyperbox_).key(point);
+		}
+
+		/*
+		 * the indices of `points` sorted along the curve the entries are ordered by (Hilbert if they are not),
+		 * so that visiting the points in that order touches the same parts of the tree in a row
+		 */
+		[[nodiscard]] std::vector<uint32_t> curveOrder(std::span<const IndexType> points) const {
+			detail::CurveEncoder<TCoord, NDims> encoder(
+				entryOrder_ == SpaceFillingCurve::None ? SpaceFillingCurve::Hilbert : entryOrder_,
+				rootHyperbox_
+			);
+			std::vector<std::pair<uint64_t, uint32_t>> keyed(points.size());
+			for(size_t i=0; i<points.size(); i++) {
+				keyed[i] = {encoder.key(points[i]), uint32_t(i)};
+			}
+			std::ranges::sort(keyed);
+			std::vector<uint32_t> order(points.size());
+			for(size_t i=0; i<points.size(); i++) {
+				order[i] = keyed[i].second;
+			}
+			return order;
+		}
+
+		[[nodiscard]] NodeBounds nodeBounds() const {
+			if(not nodeBoxesView_.empty()) {
+				return NodeBounds::Tight;
+			}
+			if(not quantizedBoundsView_.empty()) {
+				return NodeBounds::QuantizedTight;
+			}
+			return NodeBounds::Cells;
+		}
+
+		/*
+		 * whether the tree works directly out of a memory-mapped file
+		 */
+		[[nodiscard]] bool isMapped() const {
+			return mappedFile_ != nullptr;
+		}
+
+		[[nodiscard]] MemoryStats memoryStats() const {
+			return MemoryStats {
+				.numNodes = nodesView_.size(),
+				.bytesPerNode = sizeof(Node),
+				.bytesPerNodePointerBased = sizeof(detail::PointerBasedNode<EntryType, HyperboxSplitType>),
+				.nodeBytes = nodesView_.size_bytes(),
+				.entryBytes = entriesView_.size_bytes() + weightsView_.size_bytes(),
+				.soaBytes = soaCoordsView_.size_bytes() + soaLabelsView_.size_bytes(),
+				.boundsBytes = nodeBoxesView_.size_bytes() + quantizedBoundsView_.size_bytes()
+			};
 		}
 
 		KDTree(const KDTree&) = delete;
@@ -95,76 +448,376 @@ namespace iui {
 		KDTree(KDTree&&) = default;
 		KDTree& operator=(KDTree&&) = default;
 
+		/*
+		 * the predicate is given each node's cell, or its bounding box if the tree was built with NodeBounds other than Cells
+		 */
 		template<std::invocable<EntryType> FnT, std::invocable<HyperboxType> PredFnT>
 		void walk(FnT&& fn, PredFnT&& hboxPredicate) const {
 			HyperboxType hbox = rootHyperbox_;
-			struct DataVisitor {
-				FnT fn;
-				PredFnT hboxPredicate;
-				HyperboxType& hbox;
-
-				void operator()(const std::span<const EntryType> entries) {
-					for(const auto& entry: entries) {
+			if(nodeBounds() != NodeBounds::Cells) {
+				auto leafFn = [&](const Node& leaf) {
+					for(const auto& entry: leafEntries(leaf)) {
 						fn(entry);
 					}
-				}
-				void operator()(InnerNodeType innerNode) {
-					{
-						typename HyperboxType::ScopedLeftSplitter splitter(hbox, innerNode.split);
-						if(hboxPredicate(hbox)) {
-							std::visit(*this, innerNode.lchild->data);
-						}
-					}
-					{
-						typename HyperboxType::ScopedRightSplitter splitter(hbox, innerNode.split);
-						if(hboxPredicate(hbox)) {
-							std::visit(*this, innerNode.rchild->data);
-						}
+				};
+				walkNodeBounded(0, nullptr, hbox, leafFn, hboxPredicate);
+				return;
+			}
+			walkNode(0, hbox, fn, hboxPredicate);
+		}
+
+		/*
+		 * like walk(), but descends into the child on the same side of the split as `point` first.
+		 * the predicate for the far child is evaluated only after the near subtree has been walked,
+		 * so a predicate whose search radius shrinks during the walk prunes more of the tree.
+		 */
+		template<std::invocable<EntryType> FnT, std::invocable<HyperboxType> PredFnT>
+		void walkNearestFirst(const IndexType& point, FnT&& fn, PredFnT&& hboxPredicate) const {
+			walkLeavesNearestFirst(
+				point,
+				[&](const Node& leaf) {
+					for(const auto& entry: leafEntries(leaf)) {
+						fn(entry);
 					}
+				},
+				hboxPredicate
+			);
+		}
+
+		/*
+		 * like walkNearestFirst(), but calls `leafFn` once per leaf so that it can scan the leaf as a whole
+		 */
+		template<std::invocable<const Node&> LeafFnT, std::invocable<HyperboxType> PredFnT>
+		void walkLeavesNearestFirst(const IndexType& point, LeafFnT&& leafFn, PredFnT&& hboxPredicate) const {
+			HyperboxType hbox = rootHyperbox_;
+			if(nodeBounds() != NodeBounds::Cells) {
+				walkNodeBounded(0, &point, hbox, leafFn, hboxPredicate);
+				return;
+			}
+			walkNodeNearestFirst(0, point, hbox, leafFn, hboxPredicate);
+		}
 
+		/*
+		 * like walkLeavesNearestFirst(), but the predicate gets the reduced distance from `point` to the child's cell
+		 * instead of its hyperbox. only the split axis changes between a cell and its children, so the distance is
+		 * updated in O(1) per node from a per-axis offset (Arya & Mount): `axisDistance(offset)` must return
+		 * the reduced distance contribution of an offset along one axis, and the reduced distance must be
+		 * the sum of these contributions.
+		 * with NodeBounds other than Cells, a child whose cell passes the predicate is tested again with the distance
+		 * to its bounding box, which is never smaller but takes O(NDims).
+		 */
+		template<std::invocable<const Node&> LeafFnT, std::invocable<double> AxisDistFnT, std::predicate<double> PredFnT>
+		void walkLeavesIncremental(const IndexType& point, LeafFnT&& leafFn, AxisDistFnT&& axisDistance, PredFnT&& cellDistancePredicate) const {
+			std::array<double, NDims> offsets;
+			double cellDistance = 0.0;
+			for(int axis=0; axis<NDims; axis++) {
+				double offset = 0.0;
+				if(point[axis] < rootHyperbox_.pos0[axis]) {
+					offset = double(rootHyperbox_.pos0[axis]) - double(point[axis]);
+				} else if(point[axis] > rootHyperbox_.pos1[axis]) {
+					offset = double(point[axis]) - double(rootHyperbox_.pos1[axis]);
 				}
-			};
-			return std::visit(DataVisitor{fn, hboxPredicate, hbox}, rootNode()->data);
+				offsets[axis] = offset;
+				cellDistance += axisDistance(offset);
+			}
+			const HyperboxType* hbox = nodeBounds() != NodeBounds::Cells ? &rootHyperbox_ : nullptr;
+			walkNodeIncremental(0, point, offsets, cellDistance, hbox, leafFn, axisDistance, cellDistancePredicate);
 		}
 
 		[[nodiscard]] size_t numEntries() const {
-			return entries_.size();
+			return entriesView_.size();
+		}
+
+		static constexpr detail::SerializedTypeInfo serializedTypeInfo(int inputDims = NDims) {
+			return detail::SerializedTypeInfo {
+				.inputDims = inputDims,
+				.treeDims = NDims,
+				.coordSize = sizeof(TCoord),
+				.coordKind = detail::numericKindOf<TCoord>(),
+				.labelSize = sizeof(TLabel),
+				.labelKind = detail::numericKindOf<TLabel>(),
+				.entrySize = sizeof(EntryType),
+				.nodeSize = sizeof(Node)
+			};
+		}
+
+		void serialize(detail::BinaryWriter& writer) const
+			requires std::is_trivially_copyable_v<EntryType>
+		{
+			writer.writeValue(detail::sectionTag("TINF"), SerializedTreeInfo {
+				.maxLeafElements = maxLeafElements_,
+				.soaAxisStride = soaAxisStride_,
+				.entryOrder = uint64_t(entryOrder_)
+			});
+			writer.writeValue(detail::sectionTag("HBOX"), rootHyperbox_);
+			writer.writeSection(detail::sectionTag("NODE"), nodesView_);
+			writer.writeSection(detail::sectionTag("ENTR"), entriesView_);
+			writer.writeSection(detail::sectionTag("WGHT"), weightsView_);
+			writer.writeSection(detail::sectionTag("SOAC"), soaCoordsView_);
+			writer.writeSection(detail::sectionTag("SOAL"), soaLabelsView_);
+			writer.writeSection(detail::sectionTag("NBOX"), nodeBoxesView_);
+			writer.writeSection(detail::sectionTag("QBOX"), quantizedBoundsView_);
+		}
+
+		/*
+		 * the returned tree refers to the reader's mapped file instead of copying the arrays out of it
+		 */
+		[[nodiscard]] static KDTree deserialize(detail::BinaryReader& reader)
+			requires std::is_trivially_copyable_v<EntryType>
+		{
+			KDTree tree(detail::KDTreeFromFileTagT {});
+			auto info = reader.readValue<SerializedTreeInfo>(detail::sectionTag("TINF"));
+			tree.maxLeafElements_ = info.maxLeafElements;
+			tree.soaAxisStride_ = info.soaAxisStride;
+			if(info.entryOrder > uint64_t(SpaceFillingCurve::Hilbert)) {
+				throw SerializationError(std::format("serialized tree has unknown entry order {}", info.entryOrder));
+			}
+			tree.entryOrder_ = SpaceFillingCurve(info.entryOrder);
+			tree.rootHyperbox_ = reader.readValue<HyperboxType>(detail::sectionTag("HBOX"));
+			tree.nodesView_ = reader.readSection<Node>(detail::sectionTag("NODE"));
+			tree.entriesView_ = reader.readSection<EntryType>(detail::sectionTag("ENTR"));
+			tree.weightsView_ = reader.readSection<uint32_t>(detail::sectionTag("WGHT"));
+			tree.soaCoordsView_ = reader.readSection<TCoord>(detail::sectionTag("SOAC"));
+			tree.soaLabelsView_ = reader.readSection<TLabel>(detail::sectionTag("SOAL"));
+			tree.nodeBoxesView_ = reader.readSection<HyperboxType>(detail::sectionTag("NBOX"));
+			tree.quantizedBoundsView_ = reader.readSection<QuantizedBounds>(detail::sectionTag("QBOX"));
+			tree.mappedFile_ = reader.file();
+
+			if(tree.nodesView_.empty()) {
+				throw SerializationError("serialized tree has no nodes");
+			}
+			if(not tree.weightsView_.empty() && tree.weightsView_.size() != tree.entriesView_.size()) {
+				throw SerializationError("serialized tree has inconsistent entry weights");
+			}
+			if(tree.hasSoALeaves() && (tree.soaLabelsView_.size() != tree.entriesView_.size() || tree.soaAxisStride_ < tree.entriesView_.size()
+				|| tree.soaCoordsView_.size() != tree.soaAxisStride_ * NDims)
+			) {
+				throw SerializationError("serialized tree has inconsistent leaf arrays");
+			}
+			for(size_t numBounds: {tree.nodeBoxesView_.size(), tree.quantizedBoundsView_.size()}) {
+				if(numBounds != 0 && numBounds != tree.nodesView_.size()) {
+					throw SerializationError("serialized tree has inconsistent node bounds");
+				}
+			}
+			/* the walks trust the nodes, so a corrupted file must not get past here even without a checksum */
+			for(size_t i=0; i<tree.nodesView_.size(); i++) {
+				const Node& node = tree.nodesView_[i];
+				if(node.isLeaf()) {
+					if(node.firstEntry > node.rchildOrLastEntry || node.rchildOrLastEntry > tree.entriesView_.size()) {
+						throw SerializationError(std::format("serialized tree node {} has an invalid entry range", i));
+					}
+				} else if(node.axisOrTag >= uint32_t(NDims) || node.rchildOrLastEntry <= i + 1 || node.rchildOrLastEntry >= tree.nodesView_.size()) {
+					/* children follow their parent in depth-first order, which also rules out cycles */
+					throw SerializationError(std::format("serialized tree node {} has an invalid split or child", i));
+				}
+			}
+			return tree;
 		}
 
 	private:
 
-		struct HyperboxSplitRecord {
-			double score {};
-			HyperboxSplitType split {};
+		struct SerializedTreeInfo {
+			uint64_t maxLeafElements;
+			uint64_t soaAxisStride;
+			uint64_t entryOrder;
 		};
 
-		[[nodiscard]] static HyperboxSplitRecord trySplit(std::span<EntryType> entries, int axis) {
-			int mid = entries.size() / 2;
-			std::nth_element(entries.begin(), entries.begin()+mid, entries.end(), [axis](const EntryType& a, const EntryType& b) {
-				return a.coord[axis] < b.coord[axis];
-			});
-			auto median = entries[mid].coord[axis];
-			auto midpoint = std::partition(entries.begin(), entries.end(), [axis, median](const EntryType& entry) {
-				return entry.coord[axis] < median;
-			});
-			auto leftSubspan = std::span {entries.begin(), midpoint};
-			auto rightSubspan = std::span {midpoint, entries.end()};
+		explicit KDTree(detail::KDTreeFromFileTagT) {}
 
-			int sizeDiff = std::abs(std::ssize(leftSubspan) - std::ssize(rightSubspan));
-			int maxAbsInvScore = std::ssize(entries) - (std::ssize(entries) % 2);
-			int absInvScore = std::ssize(entries) - sizeDiff;
+		void updateViews() {
+			nodesView_ = nodes_;
+			entriesView_ = entries_;
+			weightsView_ = weights_;
+			soaCoordsView_ = soaCoords_;
+			soaLabelsView_ = soaLabels_;
+			nodeBoxesView_ = nodeBoxes_;
+			quantizedBoundsView_ = quantizedBounds_;
+		}
 
-			double score = double(absInvScore) / double(maxAbsInvScore);
+		template<typename FnT, typename PredFnT>
+		void walkNode(uint32_t nodeIndex, HyperboxType& hbox, FnT& fn, PredFnT& hboxPredicate) const {
+			const Node& node = nodesView_[nodeIndex];
+			if(node.isLeaf()) {
+				for(const auto& entry: leafEntries(node)) {
+					fn(entry);
+				}
+				return;
+			}
+			{
+				typename HyperboxType::ScopedLeftSplitter splitter(hbox, node.split());
+				if(hboxPredicate(hbox)) {
+					walkNode(nodeIndex + 1, hbox, fn, hboxPredicate);
+				}
+			}
+			{
+				typename HyperboxType::ScopedRightSplitter splitter(hbox, node.split());
+				if(hboxPredicate(hbox)) {
+					walkNode(node.rchildOrLastEntry, hbox, fn, hboxPredicate);
+				}
+			}
+		}
 
-			return HyperboxSplitRecord {
-				.score = score,
-				.split = {
-					.axis = axis,
-					.value = median
+		template<typename LeafFnT, typename PredFnT>
+		void walkNodeNearestFirst(uint32_t nodeIndex, const IndexType& point, HyperboxType& hbox, LeafFnT& leafFn, PredFnT& hboxPredicate) const {
+			const Node& node = nodesView_[nodeIndex];
+			if(node.isLeaf()) {
+				leafFn(node);
+				return;
+			}
+			auto visitLeft = [&]() {
+				typename HyperboxType::ScopedLeftSplitter splitter(hbox, node.split());
+				if(hboxPredicate(hbox)) {
+					walkNodeNearestFirst(nodeIndex + 1, point, hbox, leafFn, hboxPredicate);
 				}
 			};
+			auto visitRight = [&]() {
+				typename HyperboxType::ScopedRightSplitter splitter(hbox, node.split());
+				if(hboxPredicate(hbox)) {
+					walkNodeNearestFirst(node.rchildOrLastEntry, point, hbox, leafFn, hboxPredicate);
+				}
+			};
+			if(point[node.axisOrTag] < node.splitValue) {
+				visitLeft();
+				visitRight();
+			} else {
+				visitRight();
+				visitLeft();
+			}
+		}
+
+		/*
+		 * walks with the nodes' bounding boxes; `hbox` is the box of `nodeIndex`.
+		 * if `point` is given, the child on its side of the split is visited first
+		 */
+		template<typename LeafFnT, typename PredFnT>
+		void walkNodeBounded(uint32_t nodeIndex, const IndexType* point, const HyperboxType& hbox, LeafFnT& leafFn, PredFnT& hboxPredicate) const {
+			const Node& node = nodesView_[nodeIndex];
+			if(node.isLeaf()) {
+				leafFn(node);
+				return;
+			}
+			uint32_t firstIndex = nodeIndex + 1;
+			uint32_t secondIndex = node.rchildOrLastEntry;
+			if(point && not ((*point)[node.axisOrTag] < node.splitValue)) {
+				std::swap(firstIndex, secondIndex);
+			}
+			visitChildBounded(firstIndex, point, hbox, leafFn, hboxPredicate);
+			visitChildBounded(secondIndex, point, hbox, leafFn, hboxPredicate);
 		}
 
+		template<typename LeafFnT, typename PredFnT>
+		void visitChildBounded(uint32_t childIndex, const IndexType* point, const HyperboxType& parentBox, LeafFnT& leafFn, PredFnT& hboxPredicate) const {
+			if(not nodeBoxesView_.empty()) {
+				const HyperboxType& childBox = nodeBoxesView_[childIndex];
+				if(hboxPredicate(childBox)) {
+					walkNodeBounded(childIndex, point, childBox, leafFn, hboxPredicate);
+				}
+				return;
+			}
+			HyperboxType childBox = decodeBounds(quantizedBoundsView_[childIndex], parentBox);
+			if(hboxPredicate(childBox)) {
+				walkNodeBounded(childIndex, point, childBox, leafFn, hboxPredicate);
+			}
+		}
+
+		[[nodiscard]] static HyperboxType decodeBounds(const QuantizedBounds& quantized, const HyperboxType& parentBox) {
+			HyperboxType result;
+			for(int axis=0; axis<NDims; axis++) {
+				double extent = double(parentBox.pos1[axis]) - double(parentBox.pos0[axis]);
+				result.pos0[axis] = decodeLowerBound(quantized.lower[axis], parentBox.pos0[axis], extent);
+				result.pos1[axis] = decodeUpperBound(quantized.upper[axis], parentBox.pos1[axis], extent);
+			}
+			return result;
+		}
+
+		static constexpr int MaxQuantizationStep = std::numeric_limits<uint8_t>::max();
+
+		static constexpr auto QuantizationFractions = []() {
+			std::array<double, MaxQuantizationStep + 1> result {};
+			for(int step=0; step<=MaxQuantizationStep; step++) {
+				result[step] = double(step) / MaxQuantizationStep;
+			}
+			return result;
+		}();
+
+		/*
+		 * step 0 decodes to the parent's bound exactly, and integral offsets are truncated towards it.
+		 * the build decodes through the same functions, so it can check that the result contains the entries
+		 */
+		[[nodiscard]] static TCoord decodeLowerBound(uint8_t step, TCoord parentLower, double extent) {
+			return TCoord(parentLower + TCoord(extent * QuantizationFractions[step]));
+		}
+
+		[[nodiscard]] static TCoord decodeUpperBound(uint8_t step, TCoord parentUpper, double extent) {
+			return TCoord(parentUpper - TCoord(extent * QuantizationFractions[step]));
+		}
+
+		template<typename LeafFnT, typename AxisDistFnT, typename PredFnT>
+		void walkNodeIncremental(
+			uint32_t nodeIndex,
+			const IndexType& point,
+			std::array<double, NDims>& offsets,
+			double cellDistance,
+			const HyperboxType* hbox,
+			LeafFnT& leafFn,
+			AxisDistFnT& axisDistance,
+			PredFnT& cellDistancePredicate
+		) const {
+			const Node& node = nodesView_[nodeIndex];
+			if(node.isLeaf()) {
+				leafFn(node);
+				return;
+			}
+			int axis = node.axisOrTag;
+			double diff = double(point[axis]) - double(node.splitValue);
+			uint32_t nearIndex = nodeIndex + 1;
+			uint32_t farIndex = node.rchildOrLastEntry;
+			if(diff >= 0) {
+				std::swap(nearIndex, farIndex);
+			}
+
+			/* `hbox` is the node's bounding box, or null if the tree only has cells */
+			auto visitChild = [&](uint32_t childIndex, double childCellDistance) {
+				if(not hbox) {
+					walkNodeIncremental(childIndex, point, offsets, childCellDistance, nullptr, leafFn, axisDistance, cellDistancePredicate);
+					return;
+				}
+				HyperboxType decodedBox;
+				const HyperboxType* childBox = &decodedBox;
+				if(not nodeBoxesView_.empty()) {
+					childBox = &nodeBoxesView_[childIndex];
+				} else {
+					decodedBox = decodeBounds(quantizedBoundsView_[childIndex], *hbox);
+				}
+				double boxDistance = 0.0;
+				for(int i=0; i<NDims; i++) {
+					double offset = 0.0;
+					if(point[i] < childBox->pos0[i]) {
+						offset = double(childBox->pos0[i]) - double(point[i]);
+					} else if(point[i] > childBox->pos1[i]) {
+						offset = double(point[i]) - double(childBox->pos1[i]);
+					}
+					boxDistance += axisDistance(offset);
+				}
+				if(cellDistancePredicate(boxDistance)) {
+					walkNodeIncremental(childIndex, point, offsets, childCellDistance, childBox, leafFn, axisDistance, cellDistancePredicate);
+				}
+			};
+
+			visitChild(nearIndex, cellDistance);
+
+			/* `point` lies on the near side, so the far cell is at least as far away along `axis` as the current one */
+			double oldOffset = offsets[axis];
+			double newOffset = std::fabs(diff);
+			double farDistance = cellDistance - axisDistance(oldOffset) + axisDistance(newOffset);
+			if(cellDistancePredicate(farDistance)) {
+				offsets[axis] = newOffset;
+				visitChild(farIndex, farDistance);
+				offsets[axis] = oldOffset;
+			}
+		}
+
+
 		std::array<std::span<EntryType>, 2> applySplit(std::span<EntryType> entries, HyperboxSplitType split) {
 			auto belongsToLeft = [&split](const EntryType& entry) {
 				return entry.coord[split->axis] < split->value;
@@ -199,91 +852,378 @@ namespace iui {
 		// 	}
 		// }
 
-		[[nodiscard]] static std::optional<HyperboxSplitType> findApproximateSplit(std::span<EntryType> entries) {
-			std::vector<HyperboxSplitRecord> splits;
-
-			static std::mt19937_64 gen(std::random_device{}());
-			static constexpr double ViableScoreThreshold = 0.9;
+		/*
+		 * estimates the per-axis mean and variance from entries drawn at random (the entries of a node are in
+		 * partition or curve order, so the first ones are not representative) and splits at the mean
+		 * of an axis picked at random among the `numCandidateAxes` with the highest variance
+		 */
+		[[nodiscard]] static std::optional<HyperboxSplitType> findRandomizedSplit(std::span<EntryType> entries, std::mt19937_64& gen, int numCandidateAxes) {
+			static constexpr size_t SampleSize = 100;
+			size_t sampleSize = std::min(SampleSize, entries.size());
+			std::array<size_t, SampleSize> sample;
+			if(entries.size() <= SampleSize) {
+				std::iota(sample.begin(), sample.begin() + sampleSize, size_t(0));
+			} else {
+				std::uniform_int_distribution<size_t> pick(0, entries.size() - 1);
+				for(size_t i=0; i<sampleSize; i++) {
+					sample[i] = pick(gen);
+				}
+			}
 
-			for(int i=0; i<std::min<int>(NDims, 2.0 + 2.0 * std::log2(NDims)); i++) {
-				int axis = std::uniform_int_distribution<int>(0, NDims-1)(gen);
-				auto rec = trySplit(entries, axis);
-				if(rec.score > ViableScoreThreshold) {
-					return rec.split;
+			std::array<double, NDims> mean {}, variance {};
+			for(size_t i=0; i<sampleSize; i++) {
+				for(int axis=0; axis<NDims; axis++) {
+					mean[axis] += entries[sample[i]].coord[axis];
+				}
+			}
+			for(int axis=0; axis<NDims; axis++) {
+				mean[axis] /= sampleSize;
+			}
+			for(size_t i=0; i<sampleSize; i++) {
+				for(int axis=0; axis<NDims; axis++) {
+					double diff = entries[sample[i]].coord[axis] - mean[axis];
+					variance[axis] += diff * diff;
 				}
-				splits.push_back(rec);
 			}
 
-			auto best = std::max_element(splits.begin(), splits.end(), [](auto&& a, auto&& b) {
-				return a.score > b.score;
+			std::array<int, NDims> axes;
+			std::iota(axes.begin(), axes.end(), 0);
+			int numCandidates = std::clamp(numCandidateAxes, 1, NDims);
+			std::partial_sort(axes.begin(), axes.begin() + numCandidates, axes.end(), [&](int a, int b) {
+				return variance[a] > variance[b];
+			});
+			int axis = axes[std::uniform_int_distribution<int>(0, numCandidates - 1)(gen)];
+			if(variance[axis] == 0.0) {
+				return std::nullopt;
+			}
+
+			TCoord value;
+			if constexpr(std::is_integral_v<TCoord>) {
+				value = TCoord(std::floor(mean[axis])) + 1;
+			} else {
+				value = TCoord(mean[axis]);
+			}
+			auto leftSize = std::ranges::count_if(entries, [axis, value](const EntryType& entry) {
+				return entry.coord[axis] < value;
 			});
-			if(best == splits.end() || best->score == 0.0) {
+			if(leftSize == 0 || leftSize == std::ssize(entries)) {
 				return std::nullopt;
 			}
-			return best->split;
+			return HyperboxSplitType {.axis = axis, .value = value};
 		}
 
 
 
 
 
-		Node* createNode(std::span<EntryType> entries, Node* parent) {
+		void buildNodeBounds(NodeBounds bounds) {
+			std::vector<HyperboxType> exactBoxes(nodes_.size());
+			computeNodeBoxes(0, exactBoxes);
+			if(bounds == NodeBounds::Tight) {
+				nodeBoxes_ = std::move(exactBoxes);
+				return;
+			}
+			quantizedBounds_.resize(nodes_.size());
+			quantizeNodeBounds(0, rootHyperbox_, exactBoxes);
+		}
 
-			nodes_.push_back({});
-			Node& result = nodes_.back();
+		HyperboxType computeNodeBoxes(uint32_t nodeIndex, std::vector<HyperboxType>& boxes) const {
+			const Node& node = nodes_[nodeIndex];
+			if(node.isLeaf()) {
+				auto coords = std::span(entries_).subspan(node.firstEntry, node.rchildOrLastEntry - node.firstEntry)
+					| std::views::transform([](const EntryType& e) { return e.coord; });
+				boxes[nodeIndex] = HyperboxType::of(coords);
+			} else {
+				auto lBox = computeNodeBoxes(nodeIndex + 1, boxes);
+				auto rBox = computeNodeBoxes(node.rchildOrLastEntry, boxes);
+				for(int axis=0; axis<NDims; axis++) {
+					boxes[nodeIndex].pos0[axis] = std::min(lBox.pos0[axis], rBox.pos0[axis]);
+					boxes[nodeIndex].pos1[axis] = std::max(lBox.pos1[axis], rBox.pos1[axis]);
+				}
+			}
+			return boxes[nodeIndex];
+		}
+
+		/*
+		 * quantizes the children of `nodeIndex` relative to `decodedBox`, the box the walks will decode for it.
+		 * steps are rounded outwards until the decoded bounds contain the exact ones
+		 */
+		void quantizeNodeBounds(uint32_t nodeIndex, const HyperboxType& decodedBox, const std::vector<HyperboxType>& exactBoxes) {
+			const Node& node = nodes_[nodeIndex];
+			if(node.isLeaf()) {
+				return;
+			}
+			for(uint32_t childIndex: {nodeIndex + 1, node.rchildOrLastEntry}) {
+				const HyperboxType& exact = exactBoxes[childIndex];
+				QuantizedBounds& quantized = quantizedBounds_[childIndex];
+				for(int axis=0; axis<NDims; axis++) {
+					TCoord lower = decodedBox.pos0[axis];
+					TCoord upper = decodedBox.pos1[axis];
+					double extent = double(upper) - double(lower);
+					int lowerStep = 0, upperStep = 0;
+					if(extent > 0) {
+						lowerStep = std::clamp(int((double(exact.pos0[axis]) - double(lower)) / extent * MaxQuantizationStep), 0, MaxQuantizationStep);
+						upperStep = std::clamp(int((double(upper) - double(exact.pos1[axis])) / extent * MaxQuantizationStep), 0, MaxQuantizationStep);
+					}
+					while(lowerStep > 0 && decodeLowerBound(lowerStep, lower, extent) > exact.pos0[axis]) {
+						lowerStep--;
+					}
+					while(upperStep > 0 && decodeUpperBound(upperStep, upper, extent) < exact.pos1[axis]) {
+						upperStep--;
+					}
+					quantized.lower[axis] = uint8_t(lowerStep);
+					quantized.upper[axis] = uint8_t(upperStep);
+				}
+			}
+			for(uint32_t childIndex: {nodeIndex + 1, node.rchildOrLastEntry}) {
+				quantizeNodeBounds(childIndex, decodeBounds(quantizedBounds_[childIndex], decodedBox), exactBoxes);
+			}
+		}
+
+		/*
+		 * the entries left after collapsing duplicates, sorted, and how often each of them occurred
+		 */
+		struct CollapsedEntries {
+			std::vector<EntryType> entries;
+			std::vector<uint32_t> weights;
+		};
+
+		[[nodiscard]] static bool entryLess(const EntryType& a, const EntryType& b) {
+			for(int axis=0; axis<NDims; axis++) {
+				if(a.coord[axis] != b.coord[axis]) {
+					return a.coord[axis] < b.coord[axis];
+				}
+			}
+			return a.label < b.label;
+		}
 
-			result.parent = parent;
-			//result.hyperbox = hbox;
-			if(entries.size() <= MaxLeafElements) {
-				result.data = entries;
+		/*
+		 * sorts the entries and merges runs of equal ones; returns nothing if there were none
+		 */
+		std::optional<CollapsedEntries> collapseDuplicateEntries() {
+			if constexpr(not std::totally_ordered<TLabel>) {
+				throw std::invalid_argument("collapsing duplicates needs labels that can be ordered");
 			} else {
+				std::ranges::sort(entries_, entryLess);
+				CollapsedEntries collapsed;
+				collapsed.weights.reserve(entries_.size());
+				size_t numCollapsed = 0;
+				for(size_t i=0; i<entries_.size(); i++) {
+					if(numCollapsed > 0 && not entryLess(entries_[numCollapsed - 1], entries_[i])) {
+						collapsed.weights.back()++;
+					} else {
+						entries_[numCollapsed++] = entries_[i];
+						collapsed.weights.push_back(1);
+					}
+				}
+				if(numCollapsed == entries_.size()) {
+					return std::nullopt;
+				}
+				entries_.resize(numCollapsed);
+				entries_.shrink_to_fit();
+				collapsed.entries = entries_;
+				return collapsed;
+			}
+		}
+
+		/*
+		 * looks up the weight of every entry after building has reordered them
+		 */
+		void attachWeights(const CollapsedEntries& collapsed) {
+			weights_.reserve(entries_.size());
+			for(const EntryType& entry: entries_) {
+				auto it = std::ranges::lower_bound(collapsed.entries, entry, entryLess);
+				weights_.push_back(collapsed.weights[it - collapsed.entries.begin()]);
+			}
+		}
+
+		/*
+		 * stable, so that equal keys keep the order building left them in
+		 */
+		void sortByCurve(std::span<EntryType> entries) const {
+			detail::CurveEncoder<TCoord, NDims> encoder(entryOrder_, rootHyperbox_);
+			std::vector<std::pair<uint64_t, EntryType>> keyed;
+			keyed.reserve(entries.size());
+			for(const EntryType& entry: entries) {
+				keyed.emplace_back(encoder.key(entry.coord), entry);
+			}
+			std::ranges::stable_sort(keyed, {}, &std::pair<uint64_t, EntryType>::first);
+			for(size_t i=0; i<entries.size(); i++) {
+				entries[i] = keyed[i].second;
+			}
+		}
+
+		void buildSoALeaves() {
+			static constexpr size_t AlignElements = std::max<size_t>(1, CacheLineSize / sizeof(TCoord));
+			soaAxisStride_ = (entries_.size() + AlignElements - 1) / AlignElements * AlignElements;
+			soaCoords_.assign(soaAxisStride_ * NDims, TCoord {});
+			soaLabels_.reserve(entries_.size());
+			for(size_t i=0; i<entries_.size(); i++) {
+				for(int axis=0; axis<NDims; axis++) {
+					soaCoords_[axis * soaAxisStride_ + i] = entries_[i].coord[axis];
+				}
+				soaLabels_.push_back(entries_[i].label);
+			}
+		}
 
-				auto split = findApproximateSplit(entries);
+		uint32_t createLeaf(std::span<EntryType> entries, std::vector<Node>& out) {
+			Node leaf {};
+			leaf.firstEntry = entries.data() - entries_.data();
+			leaf.axisOrTag = Node::LeafTag;
+			leaf.rchildOrLastEntry = leaf.firstEntry + entries.size();
+			out.push_back(leaf);
+			return out.size() - 1;
+		}
+
+		/*
+		 * appends the subtree for `entries` (inside `cell`) to `out` in depth-first order and returns the index of its root.
+		 * child indices are relative to the beginning of `out`; subtrees built on the pool
+		 * go into a vector of their own and are relocated when appended to their parent's.
+		 */
+		uint32_t createNode(std::span<EntryType> entries, const HyperboxType& cell, int depth, uint64_t seed, std::vector<Node>& out, ThreadPool* pool) {
+			if(entries.size() <= std::max<size_t>(1, maxLeafElements_)) {
+				return createLeaf(entries, out);
+			}
 
+			std::mt19937_64 gen(seed);
+			std::optional<HyperboxSplitType> split;
+			if(options_.randomizedSplitAxes > 0) {
+				split = findRandomizedSplit(entries, gen, options_.randomizedSplitAxes);
+			}
+			if(not split) {
+				split = TSplitPolicy::findSplit(entries, cell, gen);
+			}
+			if constexpr(not std::is_same_v<TSplitPolicy, ApproximateMedianSplit>) {
 				if(not split) {
-					result.data = entries;
+					split = ApproximateMedianSplit::findSplit(entries, cell, gen);
+				}
+			}
+			if(not split) {
+				/* all entries have the same coordinates; halving them on any axis keeps leaves small */
+				split = HyperboxSplitType {.axis = 0, .value = entries.front().coord[0]};
+			}
+
+			auto partitionBy = [&](std::span<EntryType> range, auto&& pred) {
+				if(range.size() < options_.parallelPartitionCutoff) {
+					return std::partition(range.begin(), range.end(), pred);
+				} else if(pool) {
+					return detail::parallelStablePartition(range, pred, *pool);
 				} else {
-					auto partition = std::partition(entries.begin(), entries.end(), [&split](const EntryType& entry) {
-						return entry.coord[split->axis] < split->value;
-					});
-
-					//auto [lHbox, rHbox] = hbox.split(*split);
-
-					auto lChildEntries = std::span(entries.begin(), partition);
-					auto rChildEntries = std::span(partition, entries.end());
-
-					if(TreeDebug) {
-						for(Node* it = &result; it; it = it->parent) {
-							printf(" ");
-						}
-						// if(NDims <= 4) {
-						// 	result.hyperbox.print();
-						// }
-						printf("[%d | %.2f] %d -> %d / %d\n",
-							split->axis,
-							(double)split->value,
-							(int)entries.size(),
-							(int)lChildEntries.size(),
-							(int)rChildEntries.size());
+					return std::stable_partition(range.begin(), range.end(), pred);
+				}
+			};
 
-					}
-					// result.hyperbox.print();
+			/*
+			 * a three-way partition: entries on the split value lie on the boundary of both children's cells,
+			 * so they can fill up whichever side is short of half the entries
+			 */
+			auto middle = entries.begin() + entries.size() / 2;
+			auto partition = partitionBy(entries, [&split](const EntryType& entry) {
+				return entry.coord[split->axis] < split->value;
+			});
+			if(partition < middle) {
+				auto equalEnd = partitionBy(std::span(partition, entries.end()), [&split](const EntryType& entry) {
+					return entry.coord[split->axis] == split->value;
+				});
+				partition = std::min(equalEnd, middle);
+			}
+			if(partition == entries.begin() || partition == entries.end()) {
+				/* the split value lies outside the entries' range (e.g. from a custom policy); halve at the median on its axis */
+				std::nth_element(entries.begin(), middle, entries.end(), [&split](const EntryType& a, const EntryType& b) {
+					return a.coord[split->axis] < b.coord[split->axis];
+				});
+				split->value = middle->coord[split->axis];
+				partition = middle;
+			}
 
-					result.data = InnerNodeType {
-						.split = *split,
-						.lchild = createNode(lChildEntries, &result),
-						.rchild = createNode(rChildEntries, &result)
-					};
+			auto lChildEntries = std::span(entries.begin(), partition);
+			auto rChildEntries = std::span(partition, entries.end());
+
+			if(TreeDebug) {
+				for(int i=0; i<=depth; i++) {
+					printf(" ");
+				}
+				printf("[%d | %.2f] %d -> %d / %d\n",
+					split->axis,
+					(double)split->value,
+					(int)entries.size(),
+					(int)lChildEntries.size(),
+					(int)rChildEntries.size());
+			}
+
+			uint32_t index = out.size();
+			Node inner {};
+			inner.splitValue = split->value;
+			inner.axisOrTag = split->axis;
+			out.push_back(inner);
+
+			auto childCells = cell.split(*split);
+			uint64_t lSeed = detail::splitMix64(seed);
+			uint64_t rSeed = detail::splitMix64(lSeed);
+
+			if(pool && rChildEntries.size() >= options_.parallelSubtreeCutoff) {
+				std::vector<Node> rNodes;
+				TaskGroup group;
+				pool->submit(group, [&]() {
+					createNode(rChildEntries, childCells.second, depth + 1, rSeed, rNodes, pool);
+				});
+				createNode(lChildEntries, childCells.first, depth + 1, lSeed, out, pool);
+				group.wait(*pool);
+
+				uint32_t offset = out.size();
+				out[index].rchildOrLastEntry = offset;
+				for(Node node: rNodes) {
+					if(not node.isLeaf()) {
+						node.rchildOrLastEntry += offset;
+					}
+					out.push_back(node);
 				}
+			} else {
+				createNode(lChildEntries, childCells.first, depth + 1, lSeed, out, pool);
+				out[index].rchildOrLastEntry = createNode(rChildEntries, childCells.second, depth + 1, rSeed, out, pool);
 			}
 
-			return &result;
+			return index;
 		}
 
+		KDTreeBuildOptions options_;
+		size_t maxLeafElements_ = MaxLeafElements;
+		SpaceFillingCurve entryOrder_ = SpaceFillingCurve::None;
 		HyperboxType rootHyperbox_;
-		std::deque<Node> nodes_;
+		std::vector<Node> nodes_;
 		std::vector<EntryType> entries_;
-		Node* rootNode_ {};
+		/* one per entry, or none if no entries were collapsed */
+		std::vector<uint32_t> weights_;
+
+		std::vector<TCoord, detail::AlignedAllocator<TCoord, CacheLineSize>> soaCoords_;
+		std::vector<TLabel> soaLabels_;
+		size_t soaAxisStride_ = 0;
+
+		/* one entry per node, or none with NodeBounds::Cells */
+		std::vector<HyperboxType> nodeBoxes_;
+		std::vector<QuantizedBounds> quantizedBounds_;
+
+		/*
+		 * all queries go through these; they point either into the vectors above or into mappedFile_
+		 */
+		std::span<const Node> nodesView_;
+		std::span<const EntryType> entriesView_;
+		std::span<const uint32_t> weightsView_;
+		std::span<const TCoord> soaCoordsView_;
+		std::span<const TLabel> soaLabelsView_;
+		std::span<const HyperboxType> nodeBoxesView_;
+		std::span<const QuantizedBounds> quantizedBoundsView_;
+		std::shared_ptr<const MappedFile> mappedFile_;
+	};
+
+	/*
+	 * binds a split policy to KDTree, for places that take a template<typename, int, typename> index
+	 * (e.g. KNNClassifier<..., KDTreeWith<SlidingMidpointSplit>::Tree>)
+	 */
+	template<typename TSplitPolicy>
+	struct KDTreeWith {
+		template<typename TLabel, int NDims, typename TCoord = double>
+		using Tree = KDTree<TLabel, NDims, TCoord, TSplitPolicy>;
 	};
 
 }
@@ -0,0 +1,530 @@
+
+#ifndef KERNELS_HPP
+#define KERNELS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <atomic>
+#include <string_view>
+#include <type_traits>
+
+#if (defined(__x86_64__) || defined(_M_X64)) && !defined(IUI_NO_SIMD)
+#include <immintrin.h>
+#define IUI_HAS_X86_KERNELS 1
+#if defined(__GNUC__) || defined(__clang__)
+#include <cpuid.h>
+#define IUI_TARGET_SSE2 __attribute__((target("sse2")))
+#define IUI_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define IUI_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,prefer-vector-width=512")))
+#define IUI_ALWAYS_INLINE __attribute__((always_inline))
+#else
+#include <intrin.h>
+#define IUI_TARGET_SSE2
+#define IUI_TARGET_AVX2
+#define IUI_TARGET_AVX512
+#define IUI_ALWAYS_INLINE
+#endif
+#else
+#define IUI_ALWAYS_INLINE
+#endif
+
+namespace iui {
+
+	/*
+	 * the instruction sets the hot kernels may be dispatched to, in increasing order
+	 */
+	enum class SimdLevel {
+		Scalar,
+		SSE2,
+		AVX2,
+		AVX512
+	};
+
+	[[nodiscard]] inline const char* simdLevelName(SimdLevel level) {
+		switch(level) {
+			case SimdLevel::SSE2:
+				return "sse2";
+			case SimdLevel::AVX2:
+				return "avx2";
+			case SimdLevel::AVX512:
+				return "avx512";
+			case SimdLevel::Scalar:
+				break;
+		}
+		return "scalar";
+	}
+
+	namespace detail {
+
+		/*
+		 * the fallback for every instruction set and the tail of every kernel
+		 */
+		template<int N, typename T>
+		inline double reducedMinkowskiScalar(const T* a, const T* b, size_t n) {
+			double result = 0.0;
+			for(size_t i=0; i<n; i++) {
+				double diff = double(b[i]) - double(a[i]);
+				if constexpr(N == 1) {
+					result += std::fabs(diff);
+				} else {
+					result += diff * diff;
+				}
+			}
+			return result;
+		}
+
+#ifdef IUI_HAS_X86_KERNELS
+
+		IUI_TARGET_SSE2 inline float horizontalSumSse2(__m128 v) {
+			v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+			v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+			return _mm_cvtss_f32(v);
+		}
+
+		template<int N>
+		IUI_TARGET_SSE2 inline double reducedMinkowskiSse2(const float* a, const float* b, size_t n) {
+			const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFF'FFFF));
+			__m128 acc0 = _mm_setzero_ps();
+			__m128 acc1 = _mm_setzero_ps();
+			size_t i = 0;
+			for(; i + 8 <= n; i += 8) {
+				__m128 d0 = _mm_sub_ps(_mm_loadu_ps(b + i), _mm_loadu_ps(a + i));
+				__m128 d1 = _mm_sub_ps(_mm_loadu_ps(b + i + 4), _mm_loadu_ps(a + i + 4));
+				if constexpr(N == 1) {
+					acc0 = _mm_add_ps(acc0, _mm_and_ps(d0, absMask));
+					acc1 = _mm_add_ps(acc1, _mm_and_ps(d1, absMask));
+				} else {
+					acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+					acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+				}
+			}
+			double result = horizontalSumSse2(_mm_add_ps(acc0, acc1));
+			return result + reducedMinkowskiScalar<N>(a + i, b + i, n - i);
+		}
+
+		/*
+		 * like the AVX2 version; the four 32-bit lanes of squared differences are exact for n < 2^17
+		 */
+		template<int N>
+		IUI_TARGET_SSE2 inline double reducedMinkowskiSse2(const uint8_t* a, const uint8_t* b, size_t n) {
+			__m128i acc = _mm_setzero_si128();
+			size_t i = 0;
+			if constexpr(N == 1) {
+				for(; i + 16 <= n; i += 16) {
+					acc = _mm_add_epi64(acc, _mm_sad_epu8(
+						_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)),
+						_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i))
+					));
+				}
+			} else {
+				const __m128i zero = _mm_setzero_si128();
+				__m128i acc32 = _mm_setzero_si128();
+				for(; i + 16 <= n; i += 16) {
+					__m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+					__m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+					__m128i dLow = _mm_sub_epi16(_mm_unpacklo_epi8(vb, zero), _mm_unpacklo_epi8(va, zero));
+					__m128i dHigh = _mm_sub_epi16(_mm_unpackhi_epi8(vb, zero), _mm_unpackhi_epi8(va, zero));
+					acc32 = _mm_add_epi32(acc32, _mm_madd_epi16(dLow, dLow));
+					acc32 = _mm_add_epi32(acc32, _mm_madd_epi16(dHigh, dHigh));
+				}
+				acc = _mm_add_epi64(_mm_unpacklo_epi32(acc32, zero), _mm_unpackhi_epi32(acc32, zero));
+			}
+			double result = double(_mm_cvtsi128_si64(acc) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc)));
+			return result + reducedMinkowskiScalar<N>(a + i, b + i, n - i);
+		}
+
+		IUI_TARGET_AVX2 inline float horizontalSumAvx2(__m256 v) {
+			__m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+			sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+			sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+			return _mm_cvtss_f32(sum);
+		}
+
+		IUI_TARGET_AVX2 inline int64_t horizontalSumAvx2(__m256i v) {
+			__m128i sum = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+			return _mm_cvtsi128_si64(sum) + _mm_extract_epi64(sum, 1);
+		}
+
+		template<int N>
+		IUI_TARGET_AVX2 inline double reducedMinkowskiAvx2(const float* a, const float* b, size_t n) {
+			const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFF'FFFF));
+			__m256 acc0 = _mm256_setzero_ps();
+			__m256 acc1 = _mm256_setzero_ps();
+			size_t i = 0;
+			for(; i + 16 <= n; i += 16) {
+				__m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(b + i), _mm256_loadu_ps(a + i));
+				__m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(b + i + 8), _mm256_loadu_ps(a + i + 8));
+				if constexpr(N == 1) {
+					acc0 = _mm256_add_ps(acc0, _mm256_and_ps(d0, absMask));
+					acc1 = _mm256_add_ps(acc1, _mm256_and_ps(d1, absMask));
+				} else {
+					acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+					acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+				}
+			}
+			double result = horizontalSumAvx2(_mm256_add_ps(acc0, acc1));
+			return result + reducedMinkowskiScalar<N>(a + i, b + i, n - i);
+		}
+
+		/*
+		 * the differences' powers are widened to 64-bit lanes, so the sums cannot overflow
+		 */
+		template<int N>
+		IUI_TARGET_AVX2 inline double reducedMinkowskiAvx2(const int32_t* a, const int32_t* b, size_t n) {
+			const __m256i lowHalves = _mm256_set1_epi64x(0xFFFF'FFFF);
+			__m256i acc = _mm256_setzero_si256();
+			size_t i = 0;
+			for(; i + 8 <= n; i += 8) {
+				__m256i d = _mm256_sub_epi32(
+					_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)),
+					_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i))
+				);
+				if constexpr(N == 1) {
+					d = _mm256_abs_epi32(d);
+					acc = _mm256_add_epi64(acc, _mm256_and_si256(d, lowHalves));
+					acc = _mm256_add_epi64(acc, _mm256_srli_epi64(d, 32));
+				} else {
+					__m256i dOdd = _mm256_srli_epi64(d, 32);
+					acc = _mm256_add_epi64(acc, _mm256_mul_epi32(d, d));
+					acc = _mm256_add_epi64(acc, _mm256_mul_epi32(dOdd, dOdd));
+				}
+			}
+			double result = double(horizontalSumAvx2(acc));
+			return result + reducedMinkowskiScalar<N>(a + i, b + i, n - i);
+		}
+
+		/*
+		 * sums of absolute differences come straight from psadbw; squared differences go through
+		 * 16-bit lanes and are summed pairwise into 32-bit lanes, which is exact for n < 2^18
+		 */
+		template<int N>
+		IUI_TARGET_AVX2 inline double reducedMinkowskiAvx2(const uint8_t* a, const uint8_t* b, size_t n) {
+			__m256i acc = _mm256_setzero_si256();
+			size_t i = 0;
+			if constexpr(N == 1) {
+				for(; i + 32 <= n; i += 32) {
+					acc = _mm256_add_epi64(acc, _mm256_sad_epu8(
+						_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)),
+						_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i))
+					));
+				}
+			} else {
+				__m256i acc32 = _mm256_setzero_si256();
+				for(; i + 16 <= n; i += 16) {
+					__m256i d = _mm256_sub_epi16(
+						_mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i))),
+						_mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)))
+					);
+					acc32 = _mm256_add_epi32(acc32, _mm256_madd_epi16(d, d));
+				}
+				acc = _mm256_add_epi64(
+					_mm256_cvtepi32_epi64(_mm256_castsi256_si128(acc32)),
+					_mm256_cvtepi32_epi64(_mm256_extracti128_si256(acc32, 1))
+				);
+			}
+			double result = double(horizontalSumAvx2(acc));
+			return result + reducedMinkowskiScalar<N>(a + i, b + i, n - i);
+		}
+
+		template<int N>
+		IUI_TARGET_AVX512 inline double reducedMinkowskiAvx512(const float* a, const float* b, size_t n) {
+			__m512 acc0 = _mm512_setzero_ps();
+			__m512 acc1 = _mm512_setzero_ps();
+			size_t i = 0;
+			for(; i + 32 <= n; i += 32) {
+				__m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(b + i), _mm512_loadu_ps(a + i));
+				__m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(b + i + 16), _mm512_loadu_ps(a + i + 16));
+				if constexpr(N == 1) {
+					acc0 = _mm512_add_ps(acc0, _mm512_abs_ps(d0));
+					acc1 = _mm512_add_ps(acc1, _mm512_abs_ps(d1));
+				} else {
+					acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+					acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+				}
+			}
+			for(; i < n; i += 16) {
+				__mmask16 mask = n - i >= 16 ? __mmask16(0xFFFF) : __mmask16((1u << (n - i)) - 1);
+				__m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, b + i), _mm512_maskz_loadu_ps(mask, a + i));
+				if constexpr(N == 1) {
+					acc0 = _mm512_add_ps(acc0, _mm512_abs_ps(d));
+				} else {
+					acc0 = _mm512_fmadd_ps(d, d, acc0);
+				}
+			}
+			return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+		}
+
+		template<int N>
+		IUI_TARGET_AVX512 inline double reducedMinkowskiAvx512(const int32_t* a, const int32_t* b, size_t n) {
+			const __m512i lowHalves = _mm512_set1_epi64(0xFFFF'FFFF);
+			__m512i acc = _mm512_setzero_si512();
+			size_t i = 0;
+			for(; i + 16 <= n; i += 16) {
+				__m512i d = _mm512_sub_epi32(_mm512_loadu_si512(b + i), _mm512_loadu_si512(a + i));
+				if constexpr(N == 1) {
+					d = _mm512_abs_epi32(d);
+					acc = _mm512_add_epi64(acc, _mm512_and_si512(d, lowHalves));
+					acc = _mm512_add_epi64(acc, _mm512_srli_epi64(d, 32));
+				} else {
+					__m512i dOdd = _mm512_srli_epi64(d, 32);
+					acc = _mm512_add_epi64(acc, _mm512_mul_epi32(d, d));
+					acc = _mm512_add_epi64(acc, _mm512_mul_epi32(dOdd, dOdd));
+				}
+			}
+			double result = double(_mm512_reduce_add_epi64(acc));
+			return result + reducedMinkowskiScalar<N>(a + i, b + i, n - i);
+		}
+
+		template<int N>
+		IUI_TARGET_AVX512 inline double reducedMinkowskiAvx512(const uint8_t* a, const uint8_t* b, size_t n) {
+			__m512i acc = _mm512_setzero_si512();
+			size_t i = 0;
+			if constexpr(N == 1) {
+				for(; i + 64 <= n; i += 64) {
+					acc = _mm512_add_epi64(acc, _mm512_sad_epu8(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i)));
+				}
+			} else {
+				__m512i acc32 = _mm512_setzero_si512();
+				for(; i + 32 <= n; i += 32) {
+					__m512i d = _mm512_sub_epi16(
+						_mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i))),
+						_mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)))
+					);
+					acc32 = _mm512_add_epi32(acc32, _mm512_madd_epi16(d, d));
+				}
+				acc = _mm512_add_epi64(
+					_mm512_cvtepi32_epi64(_mm512_castsi512_si256(acc32)),
+					_mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(acc32, 1))
+				);
+			}
+			double result = double(_mm512_reduce_add_epi64(acc));
+			return result + reducedMinkowskiScalar<N>(a + i, b + i, n - i);
+		}
+
+#endif
+
+#ifdef IUI_HAS_X86_KERNELS
+
+		struct CpuidRegisters {
+			uint32_t eax, ebx, ecx, edx;
+		};
+
+		inline CpuidRegisters cpuid(uint32_t leaf, uint32_t subleaf) {
+#if defined(__GNUC__) || defined(__clang__)
+			CpuidRegisters result {};
+			__cpuid_count(leaf, subleaf, result.eax, result.ebx, result.ecx, result.edx);
+			return result;
+#else
+			int registers[4];
+			__cpuidex(registers, int(leaf), int(subleaf));
+			return {uint32_t(registers[0]), uint32_t(registers[1]), uint32_t(registers[2]), uint32_t(registers[3])};
+#endif
+		}
+
+		/*
+		 * the register state the OS saves on context switches; wide registers are unusable without it
+		 */
+		inline uint64_t extendedControlRegister() {
+#if defined(__GNUC__) || defined(__clang__)
+			uint32_t eax, edx;
+			__asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+			return (uint64_t(edx) << 32) | eax;
+#else
+			return _xgetbv(0);
+#endif
+		}
+
+#endif
+
+		inline SimdLevel detectSimdLevel() {
+#ifdef IUI_HAS_X86_KERNELS
+			auto hasBit = [](uint32_t reg, int bit) {
+				return ((reg >> bit) & 1) != 0;
+			};
+
+			uint32_t maxLeaf = cpuid(0, 0).eax;
+			CpuidRegisters features = cpuid(1, 0);
+			if(not hasBit(features.edx, 26)) {
+				return SimdLevel::Scalar;
+			}
+			bool hasAvx = hasBit(features.ecx, 28) && hasBit(features.ecx, 27);
+			bool hasFma = hasBit(features.ecx, 12);
+			if(not hasAvx || maxLeaf < 7) {
+				return SimdLevel::SSE2;
+			}
+
+			uint64_t osState = extendedControlRegister();
+			bool osSavesYmm = (osState & 0x06) == 0x06;
+			bool osSavesZmm = (osState & 0xE6) == 0xE6;
+			CpuidRegisters extendedFeatures = cpuid(7, 0);
+			if(not (osSavesYmm && hasFma && hasBit(extendedFeatures.ebx, 5))) {
+				return SimdLevel::SSE2;
+			}
+			if(not (osSavesZmm && hasBit(extendedFeatures.ebx, 16) && hasBit(extendedFeatures.ebx, 30))) {
+				return SimdLevel::AVX2;
+			}
+			return SimdLevel::AVX512;
+#else
+			return SimdLevel::Scalar;
+#endif
+		}
+
+		/*
+		 * the best level the CPU supports, detected on first use
+		 */
+		inline SimdLevel supportedSimdLevel() {
+			static const SimdLevel level = detectSimdLevel();
+			return level;
+		}
+
+		/*
+		 * the supported level, lowered by the environment variable IUI_SIMD_LEVEL (scalar, sse2, avx2 or avx512)
+		 */
+		inline SimdLevel initialSimdLevel() {
+			SimdLevel supported = supportedSimdLevel();
+			const char* requested = std::getenv("IUI_SIMD_LEVEL");
+			if(not requested) {
+				return supported;
+			}
+			for(SimdLevel level: {SimdLevel::Scalar, SimdLevel::SSE2, SimdLevel::AVX2, SimdLevel::AVX512}) {
+				if(std::string_view(requested) == simdLevelName(level)) {
+					return level < supported ? level : supported;
+				}
+			}
+			return supported;
+		}
+
+		inline std::atomic<SimdLevel>& activeSimdLevelStorage() {
+			static std::atomic<SimdLevel> level {initialSimdLevel()};
+			return level;
+		}
+
+		inline SimdLevel activeSimdLevel() {
+			return activeSimdLevelStorage().load(std::memory_order_relaxed);
+		}
+
+#ifdef IUI_HAS_X86_KERNELS
+
+		template<typename FnT>
+		IUI_TARGET_SSE2 inline void runSse2(FnT& fn) {
+			fn();
+		}
+
+		template<typename FnT>
+		IUI_TARGET_AVX2 inline void runAvx2(FnT& fn) {
+			fn();
+		}
+
+		template<typename FnT>
+		IUI_TARGET_AVX512 inline void runAvx512(FnT& fn) {
+			fn();
+		}
+
+#endif
+
+		/*
+		 * runs `fn` compiled for the active instruction set. `fn` has to be an IUI_ALWAYS_INLINE lambda,
+		 * so that a copy of it is inlined into (and auto-vectorized for) each of the wrappers above.
+		 * SSE2 is part of the x86-64 baseline, so the scalar level runs the same code as SSE2 here
+		 */
+		template<typename FnT>
+		inline void dispatchSimd(FnT&& fn) {
+#ifdef IUI_HAS_X86_KERNELS
+			switch(activeSimdLevel()) {
+				case SimdLevel::AVX512:
+					runAvx512(fn);
+					return;
+				case SimdLevel::AVX2:
+					runAvx2(fn);
+					return;
+				case SimdLevel::SSE2:
+					runSse2(fn);
+					return;
+				case SimdLevel::Scalar:
+					break;
+			}
+#endif
+			fn();
+		}
+
+		template<typename T>
+		inline constexpr bool HasMinkowskiKernel =
+			   std::is_same_v<T, float>
+			|| std::is_same_v<T, int32_t>
+			|| std::is_same_v<T, uint8_t>;
+
+		/*
+		 * SSE2 has neither packed 32-bit abs nor packed 32-bit multiplies, so int32 vectors use the scalar kernel
+		 */
+		template<typename T>
+		inline constexpr bool HasSse2MinkowskiKernel = std::is_same_v<T, float> || std::is_same_v<T, uint8_t>;
+
+		/*
+		 * the kernels are only worth an indirect call for vectors at least this long
+		 */
+		inline constexpr int MinkowskiKernelMinDims = 32;
+
+		/*
+		 * sums of up to this many uint8 squared differences fit in the kernels' 32-bit lanes
+		 */
+		inline constexpr size_t MinkowskiKernelMaxLength = size_t(1) << 17;
+
+		/*
+		 * vectorized reduced L1 and L2 distances for each instruction set
+		 */
+		template<int N, typename T>
+			requires ((N == 1 || N == 2) && HasMinkowskiKernel<T>)
+		struct MinkowskiKernel {
+			using FunctionType = double (*)(const T*, const T*, size_t);
+
+			static FunctionType forLevel(SimdLevel level) {
+#ifdef IUI_HAS_X86_KERNELS
+				switch(level) {
+					case SimdLevel::AVX512:
+						return &reducedMinkowskiAvx512<N>;
+					case SimdLevel::AVX2:
+						return &reducedMinkowskiAvx2<N>;
+					case SimdLevel::SSE2:
+						if constexpr(HasSse2MinkowskiKernel<T>) {
+							return &reducedMinkowskiSse2<N>;
+						}
+						break;
+					case SimdLevel::Scalar:
+						break;
+				}
+#endif
+				return &reducedMinkowskiScalar<N, T>;
+			}
+
+			static double reduced(const T* a, const T* b, size_t n) {
+				return forLevel(activeSimdLevel())(a, b, n);
+			}
+		};
+
+	}
+
+	/*
+	 * the instruction set the kernels are currently dispatched to
+	 */
+	[[nodiscard]] inline SimdLevel getSimdLevel() {
+		return detail::activeSimdLevel();
+	}
+
+	/*
+	 * dispatches all kernels to `level`, or to the best supported level below it; meant for benchmarking.
+	 * returns the level actually used
+	 */
+	inline SimdLevel forceSimdLevel(SimdLevel level) {
+		SimdLevel supported = detail::supportedSimdLevel();
+		if(supported < level) {
+			level = supported;
+		}
+		detail::activeSimdLevelStorage().store(level, std::memory_order_relaxed);
+		return level;
+	}
+
+}
+
+#endif //KERNELS_HPP
@@ -4,10 +4,13 @@
 
 
 #include "kdtree.hpp"
+#include "dynamic.hpp"
+#include "forest.hpp"
 #include "metrics.hpp"
+#include "threadpool.hpp"
 
 #include <queue>
-#include <map>
+#include <numeric>
 
 namespace iui {
 
@@ -20,12 +23,131 @@ namespace iui {
 			TLabel label {};
 
 			friend auto operator<=>(const LabelScore& lhs, const LabelScore& rhs) {
-				return std::make_tuple(lhs.frequency, rhs.negTotalDistance) <=> std::make_tuple(rhs.frequency, rhs.negTotalDistance);
+				return std::make_tuple(lhs.frequency, lhs.negTotalDistance) <=> std::make_tuple(rhs.frequency, rhs.negTotalDistance);
 			}
 		};
 
+		/*
+		 * `distance` is the metric's reduced distance while searching
+		 */
+		template<typename TLabel>
+		struct KNNCandidate {
+			double distance;
+			TLabel label;
+
+			friend bool operator<(const KNNCandidate& lhs, const KNNCandidate& rhs) {
+				return lhs.distance < rhs.distance;
+			}
+		};
+
+		/*
+		 * keeps the k closest candidates seen so far in a max-heap,
+		 * so that the current k-th distance is always at the front
+		 */
+		template<typename TLabel>
+		class KNearestCandidates {
+		public:
+			using CandidateType = KNNCandidate<TLabel>;
+
+			KNearestCandidates() = default;
+
+			explicit KNearestCandidates(int k) {
+				reset(k);
+			}
+
+			/*
+			 * empties the set but keeps its storage, so that it can be reused across queries
+			 */
+			void reset(int k) {
+				k_ = k;
+				heap_.clear();
+				heap_.reserve(k);
+			}
+
+			void offer(double distance, const TLabel& label) {
+				if(heap_.size() < k_) {
+					heap_.push_back({distance, label});
+					std::push_heap(heap_.begin(), heap_.end());
+				} else if(distance < heap_.front().distance) {
+					std::pop_heap(heap_.begin(), heap_.end());
+					heap_.back() = {distance, label};
+					std::push_heap(heap_.begin(), heap_.end());
+				}
+			}
+
+			/*
+			 * offers an entry that stands for `weight` equal ones
+			 */
+			void offer(double distance, const TLabel& label, uint32_t weight) {
+				for(uint32_t i=0; i<weight && i<k_; i++) {
+					offer(distance, label);
+				}
+			}
+
+			[[nodiscard]] double worstDistance() const {
+				if(heap_.size() < k_) {
+					return std::numeric_limits<double>::infinity();
+				}
+				return heap_.front().distance;
+			}
+
+			[[nodiscard]] std::span<const CandidateType> candidates() const {
+				return heap_;
+			}
+
+		private:
+			size_t k_ = 0;
+			std::vector<CandidateType> heap_;
+		};
+
+		/*
+		 * per-query scratch state of an index, if it needs any
+		 */
+		template<typename TIndex>
+		struct IndexQueryScratch {
+			using Type = std::monostate;
+		};
+
+		template<typename TIndex>
+			requires requires { typename TIndex::QueryScratch; }
+		struct IndexQueryScratch<TIndex> {
+			using Type = typename TIndex::QueryScratch;
+		};
+
 	}
 
+	/*
+	 * IncrementalBestFirst is BestFirst with the distance to each cell updated in O(1) per node
+	 * instead of being recomputed from its hyperbox; indexes or metrics that do not support it
+	 * fall back to BestFirst
+	 */
+	enum class KNNSearchStrategy {
+		RadiusDoubling,
+		BestFirst,
+		IncrementalBestFirst
+	};
+
+	/*
+	 * trades exactness for speed in best-first search.
+	 * subtrees are pruned with the current k-th distance divided by (1 + epsilon), so every returned neighbor
+	 * is at most (1 + epsilon) times farther away than the true one. once k candidates have been found,
+	 * the search also stops after `maxLeavesVisited` leaves.
+	 */
+	struct KNNApproximation {
+		double epsilon = 0.0;
+		std::optional<int64_t> maxLeavesVisited;
+	};
+
+	/*
+	 * two-stage search for classifiers that reduce dimensions: the tree finds k * candidateMultiplier candidates
+	 * in the reduced space, which are then re-ranked by their exact distance to the query in the input space.
+	 * the classifier keeps the input vectors next to the tree for this; 0 turns it off.
+	 * only affects the best-first strategies, and needs an index with leaf access (KDTree)
+	 */
+	struct KNNReranking {
+		int candidateMultiplier = 0;
+	};
+
 	template<typename TCoord, int NDimsSrc, int NDimsDst>
 	struct NoDimensionalityReduction {
 		static_assert(NDimsSrc == NDimsDst);
@@ -36,6 +158,8 @@ namespace iui {
 		using InputType = Vec<TCoord, NumInputDims>;
 		using OutputType = Vec<TCoord, NumOutputDims>;
 
+		NoDimensionalityReduction() = default;
+
 		explicit NoDimensionalityReduction(std::ranges::range auto range) {
 
 		}
@@ -44,6 +168,14 @@ namespace iui {
 			return input;
 		}
 
+		void serialize(detail::BinaryWriter& writer) const {
+
+		}
+
+		[[nodiscard]] static NoDimensionalityReduction deserialize(detail::BinaryReader& reader) {
+			return {};
+		}
+
 	};
 
 	inline double divOrZero(double a, double b) {
@@ -58,6 +190,12 @@ namespace iui {
 		int accuratePredictions = 0;
 		int64_t pointsConsidered = 0;
 		int64_t pointsSkipped = 0;
+		int64_t leavesVisited = 0;
+		int64_t searchesTruncated = 0;
+		/* coordinates read while computing distances to the visited points */
+		int64_t coordinatesTouched = 0;
+		/* queries of a coalesced batch that repeated the previous one and were answered without a search */
+		int64_t queriesCoalesced = 0;
 
 		[[nodiscard]] double accuracy() const {
 			return divOrZero(accuratePredictions, totalPredictions);
@@ -66,23 +204,49 @@ namespace iui {
 		[[nodiscard]] double efficiency() const {
 			return divOrZero(pointsSkipped, pointsConsidered);
 		}
+
+		[[nodiscard]] int64_t pointsVisited() const {
+			return pointsConsidered - pointsSkipped;
+		}
+
+		/*
+		 * the fraction of the visited points' coordinates that distance evaluations had to read
+		 */
+		[[nodiscard]] double coordinatesTouchedRatio(int numDims) const {
+			return divOrZero(coordinatesTouched, double(pointsVisited()) * numDims);
+		}
+
+		KNNClassifierStats& operator+=(const KNNClassifierStats& rhs) {
+			totalPredictions += rhs.totalPredictions;
+			accuratePredictions += rhs.accuratePredictions;
+			pointsConsidered += rhs.pointsConsidered;
+			pointsSkipped += rhs.pointsSkipped;
+			leavesVisited += rhs.leavesVisited;
+			searchesTruncated += rhs.searchesTruncated;
+			coordinatesTouched += rhs.coordinatesTouched;
+			queriesCoalesced += rhs.queriesCoalesced;
+			return *this;
+		}
 	};
 
 
 
 	template<
-		typename TMetric,
+		DistanceMetric TMetric,
 		typename TLabel,
 		typename TCoord,
 		int NDims,
 		template<typename, int, int> typename TDimensionalityReducer = NoDimensionalityReduction,
-		int NTreeDims = NDims
+		int NTreeDims = NDims,
+		template<typename, int, typename, typename...> typename TIndex = KDTree
 	>
 	struct KNNClassifier {
 
 		static inline constexpr int NumTreeDimensions = NTreeDims;
 
 		using MetricType = TMetric;
+		using LabelType = TLabel;
+		using TreeType = TIndex<TLabel, NTreeDims, TCoord>;
 		using PointType = Vec<TCoord, NDims>;
 		using DistanceType = double;
 		using DimensionalityReducerType = std::conditional_t<
@@ -91,17 +255,63 @@ namespace iui {
 			NoDimensionalityReduction<TCoord, NDims, NTreeDims>
 		>;
 
+		/*
+		 * what a query in a coalesced batch leaves to the next one: its point, the true distance
+		 * to its k-th neighbor and the first leaf it reached (if the index has leaves)
+		 */
+		struct WarmStart {
+			bool valid = false;
+			typename TreeType::IndexType point {};
+			double kthDistance = std::numeric_limits<double>::infinity();
+			int64_t leafIndex = -1;
+		};
+
+		/*
+		 * everything a query writes to: the search radius hint, the stats and scratch buffers
+		 * that are reused so that queries do not allocate once they have warmed up.
+		 * any number of threads may query one classifier concurrently, each through a context of its own.
+		 */
+		struct QueryContext {
+			double defaultSearchRadius = std::numeric_limits<double>::max();
+			KNNClassifierStats stats;
+
+			std::vector<detail::KNNCandidate<TLabel>> candidates;
+			detail::KNearestCandidates<TLabel> nearest;
+			detail::KNearestCandidates<uint32_t> entryNearest;
+			std::vector<detail::LabelScore<TLabel>> labelScores;
+			std::vector<detail::SoADistanceType<TCoord>> leafDistances;
+			typename detail::IndexQueryScratch<TreeType>::Type indexScratch;
+			WarmStart warmStart;
+		};
+
 		template<std::ranges::sized_range TRange>
 			requires detail::AggregateEntryInitType<std::remove_cvref_t<std::ranges::range_value_t<TRange>>>
-		explicit KNNClassifier(TRange&& range)
-			: dimensionalityReducer_(range | std::views::transform([](auto&& entry) {
+		explicit KNNClassifier(TRange&& range, const KDTreeBuildOptions& treeOptions = {}, const KNNReranking& reranking = {})
+			: KNNClassifier(DimensionalityReducerType(range | std::views::transform([](auto&& entry) {
 				const auto& [position, label] = entry;
 		      	return position;
-		      })),
-			kdTree_((range | std::views::transform([this](auto&& entry) {
-				const auto& [position, label] = entry;
-				return typename decltype(kdTree_)::EntryType {dimensionalityReducer_.reduce(position), label};
-			})), detail::KDTreeFromRangeTagT{})
+		      })), std::forward<TRange>(range), treeOptions, reranking)
+		{
+
+		}
+
+		/*
+		 * builds the tree with an already fitted reducer, e.g. one of the slices of a PCAModel,
+		 * so that classifiers over the same data do not each fit their own
+		 */
+		template<std::ranges::sized_range TRange>
+			requires detail::AggregateEntryInitType<std::remove_cvref_t<std::ranges::range_value_t<TRange>>>
+		KNNClassifier(
+			DimensionalityReducerType dimensionalityReducer,
+			TRange&& range,
+			const KDTreeBuildOptions& treeOptions = {},
+			const KNNReranking& reranking = {}
+		) : KNNClassifier(
+				std::move(dimensionalityReducer),
+				reduceTrainingSet(dimensionalityReducer, range, reranking.candidateMultiplier > 0),
+				treeOptions,
+				reranking
+			)
 		{
 
 		}
@@ -113,23 +323,528 @@ namespace iui {
 			std::optional<DistanceType> initialDist = std::nullopt,
 			std::optional<TLabel> trueLabel = std::nullopt
 		) {
+			return predict(point, defaultContext_, k, initialDist, trueLabel);
+		}
 
+		/*
+		 * const overload that keeps all per-query state in `context`
+		 */
+		[[nodiscard]] TLabel predict(
+			const PointType& point,
+			QueryContext& context,
+			int k = 3,
+			std::optional<DistanceType> initialDist = std::nullopt,
+			std::optional<TLabel> trueLabel = std::nullopt
+		) const {
+			return predictReduced(dimensionalityReducer_.reduce(point), context, clampK(k), initialDist, trueLabel, false, &point);
+		}
+
+		/*
+		 * predicts labels for all `points` on the pool and writes them to `out`.
+		 * every chunk of queries gets a QueryContext of its own, seeded with the classifier's
+		 * search radius hint; their stats are merged into the classifier's once all chunks are done.
+		 * if the tree's entries are ordered along a space-filling curve, the queries are answered in that order,
+		 * so that each chunk gets queries close to each other
+		 */
+		void predictBatch(
+			std::span<const PointType> points,
+			std::span<TLabel> out,
+			int k,
+			ThreadPool& pool,
+			std::span<const TLabel> trueLabels = {}
+		) {
+			if(out.size() < points.size()) {
+				throw std::invalid_argument("output span is smaller than the batch");
+			}
+			if(not trueLabels.empty() && trueLabels.size() < points.size()) {
+				throw std::invalid_argument("label span is smaller than the batch");
+			}
+			k = clampK(k);
+
+			size_t chunkSize = std::max<size_t>(16, points.size() / (8 * pool.numThreads()) + 1);
+			std::vector<TreePointType> reducedStorage;
+			std::span<const TreePointType> reducedPoints = reduceQueries(points, chunkSize, pool, reducedStorage);
+			std::vector<uint32_t> order;
+			if constexpr(HasCurveOrder) {
+				if(kdTree_.entryOrder() != SpaceFillingCurve::None) {
+					order = kdTree_.curveOrder(reducedPoints);
+				}
+			}
+
+			std::vector<QueryContext> chunkContexts((points.size() + chunkSize - 1) / chunkSize);
+			for(auto& chunkContext: chunkContexts) {
+				chunkContext.defaultSearchRadius = defaultContext_.defaultSearchRadius;
+			}
+
+			pool.parallelFor(points.size(), chunkSize, [&](size_t begin, size_t end) {
+				QueryContext& chunkContext = chunkContexts[begin / chunkSize];
+				for(size_t position=begin; position<end; position++) {
+					size_t i = order.empty() ? position : order[position];
+					std::optional<TLabel> trueLabel;
+					if(not trueLabels.empty()) {
+						trueLabel = trueLabels[i];
+					}
+					out[i] = predictReduced(reducedPoints[i], chunkContext, k, std::nullopt, trueLabel, false, &points[i]);
+				}
+			});
+
+			for(const auto& chunkContext: chunkContexts) {
+				defaultContext_.stats += chunkContext.stats;
+				defaultContext_.defaultSearchRadius = std::max(defaultContext_.defaultSearchRadius, chunkContext.defaultSearchRadius);
+			}
+		}
+
+		/*
+		 * like predictBatch(), for batches with many repeated or nearby queries (e.g. the pixels of an image).
+		 * the reduced queries are sorted along a Hilbert curve through their bounding box, with exact repeats
+		 * next to each other; a repeat (of the input point, when re-ranking) gets the previous query's label without a search, and every other query
+		 * of a chunk starts where the previous one ended: in its first leaf, bounded by its k-th distance plus
+		 * the distance between the two. the labels are written back in the batch's order.
+		 * the warm start needs a best-first strategy; with radius doubling, the queries still share the
+		 * chunk's search radius hint, which the sorted order keeps close to the right one
+		 */
+		void predictBatchCoalesced(
+			std::span<const PointType> points,
+			std::span<TLabel> out,
+			int k,
+			ThreadPool& pool,
+			std::span<const TLabel> trueLabels = {}
+		) {
+			if(out.size() < points.size()) {
+				throw std::invalid_argument("output span is smaller than the batch");
+			}
+			if(not trueLabels.empty() && trueLabels.size() < points.size()) {
+				throw std::invalid_argument("label span is smaller than the batch");
+			}
+			k = clampK(k);
+
+			size_t chunkSize = std::max<size_t>(16, points.size() / (8 * pool.numThreads()) + 1);
+			std::vector<TreePointType> reducedStorage;
+			std::span<const TreePointType> reducedPoints = reduceQueries(points, chunkSize, pool, reducedStorage);
+
+			std::vector<uint32_t> order(points.size());
+			std::iota(order.begin(), order.end(), uint32_t(0));
+			if(not reducedPoints.empty()) {
+				detail::CurveEncoder<TCoord, NTreeDims> encoder(SpaceFillingCurve::Hilbert, Hyperbox<TCoord, NTreeDims>::of(reducedPoints));
+				std::vector<uint64_t> keys(points.size());
+				for(size_t i=0; i<points.size(); i++) {
+					keys[i] = encoder.key(reducedPoints[i]);
+				}
+				std::ranges::sort(order, [&](uint32_t a, uint32_t b) {
+					if(keys[a] != keys[b]) {
+						return keys[a] < keys[b];
+					}
+					for(int axis=0; axis<NTreeDims; axis++) {
+						if(reducedPoints[a][axis] != reducedPoints[b][axis]) {
+							return reducedPoints[a][axis] < reducedPoints[b][axis];
+						}
+					}
+					return false;
+				});
+			}
 
-			using TDistance = double;
-			using TEntry = typename std::remove_cvref_t<decltype(kdTree_)>::EntryType;
+			std::vector<QueryContext> chunkContexts((points.size() + chunkSize - 1) / chunkSize);
+			for(auto& chunkContext: chunkContexts) {
+				chunkContext.defaultSearchRadius = defaultContext_.defaultSearchRadius;
+			}
 
-			auto reducedPoint = dimensionalityReducer_.reduce(point);
+			bool reranks = reranksCandidates();
+			pool.parallelFor(points.size(), chunkSize, [&](size_t begin, size_t end) {
+				QueryContext& chunkContext = chunkContexts[begin / chunkSize];
+				chunkContext.warmStart = {};
+				for(size_t position=begin; position<end; position++) {
+					size_t i = order[position];
+					std::optional<TLabel> trueLabel;
+					if(not trueLabels.empty()) {
+						trueLabel = trueLabels[i];
+					}
+					size_t previous = position > begin ? order[position - 1] : i;
+					if(previous != i && reducedPoints[i] == reducedPoints[previous] && (not reranks || points[i] == points[previous])) {
+						out[i] = out[previous];
+						chunkContext.stats.queriesCoalesced++;
+						recordPrediction(out[i], 0, trueLabel, chunkContext);
+					} else {
+						out[i] = predictReduced(reducedPoints[i], chunkContext, k, std::nullopt, trueLabel, true, &points[i]);
+					}
+				}
+			});
 
-			k = std::min<int>(k, kdTree_.numEntries());
+			for(const auto& chunkContext: chunkContexts) {
+				defaultContext_.stats += chunkContext.stats;
+				defaultContext_.defaultSearchRadius = std::max(defaultContext_.defaultSearchRadius, chunkContext.defaultSearchRadius);
+			}
+		}
+
+		void setSearchStrategy(KNNSearchStrategy strategy) {
+			searchStrategy_ = strategy;
+		}
+
+		[[nodiscard]] KNNSearchStrategy getSearchStrategy() const {
+			return searchStrategy_;
+		}
+
+		/*
+		 * only affects the best-first strategy
+		 */
+		void setApproximation(const KNNApproximation& approximation) {
+			if(approximation.epsilon < 0.0) {
+				throw std::invalid_argument("epsilon must not be negative");
+			}
+			if(approximation.maxLeavesVisited && *approximation.maxLeavesVisited < 1) {
+				throw std::invalid_argument("maxLeavesVisited must be positive");
+			}
+			approximation_ = approximation;
+		}
+
+		[[nodiscard]] const KNNApproximation& getApproximation() const {
+			return approximation_;
+		}
+
+		/*
+		 * changes the candidate multiplier; re-ranking can only be turned on if the classifier was built with it
+		 */
+		void setReranking(const KNNReranking& reranking) {
+			if(reranking.candidateMultiplier < 0) {
+				throw std::invalid_argument("candidateMultiplier must not be negative");
+			}
+			if(reranking.candidateMultiplier > 0 && originals_.empty() && kdTree_.numEntries() > 0) {
+				throw std::invalid_argument("the classifier was built without re-ranking and has no input vectors");
+			}
+			reranking_ = reranking;
+		}
+
+		[[nodiscard]] const KNNReranking& getReranking() const {
+			return reranking_;
+		}
+
+		[[nodiscard]] const KNNClassifierStats& getStats() const {
+			return defaultContext_.stats;
+		}
+
+		void resetStats() {
+			defaultContext_.stats = {};
+		}
+
+		[[nodiscard]] const TreeType& tree() const {
+			return kdTree_;
+		}
+
+		[[nodiscard]] const DimensionalityReducerType& dimensionalityReducer() const {
+			return dimensionalityReducer_;
+		}
+
+		void insert(const PointType& point, const TLabel& label)
+			requires requires(TreeType& tree, const typename TreeType::EntryType& entry) { tree.insert(entry); }
+		{
+			kdTree_.insert(typename TreeType::EntryType {dimensionalityReducer_.reduce(point), label});
+		}
+
+		bool erase(const PointType& point, const TLabel& label)
+			requires requires(TreeType& tree, const typename TreeType::EntryType& entry) { tree.erase(entry); }
+		{
+			return kdTree_.erase(typename TreeType::EntryType {dimensionalityReducer_.reduce(point), label});
+		}
+
+		/*
+		 * writes the dimensionality reducer and the built tree to a versioned, checksummed binary file
+		 */
+		void save(const std::string& filename) const {
+			detail::BinaryWriter writer(filename, TreeType::serializedTypeInfo(NDims));
+			dimensionalityReducer_.serialize(writer);
+			kdTree_.serialize(writer);
+			writer.writeValue(detail::sectionTag("RRNK"), int32_t(reranking_.candidateMultiplier));
+			writer.writeSection(detail::sectionTag("ORIG"), std::span<const PointType>(originals_));
+			writer.finish();
+		}
+
+		/*
+		 * maps a file written by save() into memory; the tree is used directly out of the mapping.
+		 * throws SerializationError if the file is corrupted or was written with different types or dimensions.
+		 */
+		[[nodiscard]] static KNNClassifier load(const std::string& filename, bool verifyChecksum = true) {
+			detail::BinaryReader reader(std::make_shared<const MappedFile>(filename), TreeType::serializedTypeInfo(NDims), verifyChecksum);
+			auto dimensionalityReducer = DimensionalityReducerType::deserialize(reader);
+			auto tree = TreeType::deserialize(reader);
+			int32_t candidateMultiplier = reader.readValue<int32_t>(detail::sectionTag("RRNK"));
+			auto originals = reader.readSection<PointType>(detail::sectionTag("ORIG"));
+			if(candidateMultiplier < 0 || (not originals.empty() && originals.size() != tree.numEntries())) {
+				throw SerializationError("serialized input vectors do not match the tree");
+			}
+			KNNClassifier result(std::move(dimensionalityReducer), std::move(tree));
+			result.reranking_.candidateMultiplier = candidateMultiplier;
+			result.originals_.assign(originals.begin(), originals.end());
+			return result;
+		}
+
+	private:
+		KNNClassifier(DimensionalityReducerType&& dimensionalityReducer, TreeType&& tree)
+			: dimensionalityReducer_(std::move(dimensionalityReducer)),
+			kdTree_(std::move(tree))
+		{
+
+		}
+
+		/*
+		 * the reduced training entries, and the input vectors in the same order if they are kept for re-ranking
+		 */
+		struct TrainingSet {
+			std::vector<typename TreeType::EntryType> entries;
+			std::vector<PointType> originals;
+		};
+
+		KNNClassifier(
+			DimensionalityReducerType&& dimensionalityReducer,
+			TrainingSet&& trainingSet,
+			const KDTreeBuildOptions& treeOptions,
+			const KNNReranking& reranking
+		) : dimensionalityReducer_(std::move(dimensionalityReducer)),
+			kdTree_(trainingSet.entries, detail::KDTreeFromRangeTagT{}, rerankingTreeOptions(treeOptions, reranking))
+		{
+			if(reranking.candidateMultiplier < 0) {
+				throw std::invalid_argument("candidateMultiplier must not be negative");
+			}
+			if(reranking.candidateMultiplier > 0) {
+				attachOriginals(trainingSet);
+			}
+			reranking_ = reranking;
+		}
+
+		/*
+		 * re-ranking maps every entry of the tree back to its input vector, so no two may be merged
+		 */
+		[[nodiscard]] static KDTreeBuildOptions rerankingTreeOptions(const KDTreeBuildOptions& treeOptions, const KNNReranking& reranking) {
+			KDTreeBuildOptions result = treeOptions;
+			if(reranking.candidateMultiplier > 0) {
+				result.collapseDuplicates = false;
+			}
+			return result;
+		}
+
+		[[nodiscard]] static TrainingSet reduceTrainingSet(const DimensionalityReducerType& dimensionalityReducer, auto&& range, bool keepOriginals) {
+			static constexpr size_t BlockSize = 256;
+			TrainingSet result;
+			result.entries.reserve(std::ranges::size(range));
+			if(keepOriginals) {
+				result.originals.reserve(std::ranges::size(range));
+			}
+			std::vector<PointType> positions;
+			std::vector<TreePointType> reducedPositions(BlockSize);
+			std::vector<TLabel> labels;
+			auto flush = [&]() {
+				reduceBatch(dimensionalityReducer, positions, std::span(reducedPositions).first(positions.size()));
+				for(size_t i=0; i<positions.size(); i++) {
+					result.entries.push_back(TreeEntryType {reducedPositions[i], labels[i]});
+				}
+				if(keepOriginals) {
+					result.originals.insert(result.originals.end(), positions.begin(), positions.end());
+				}
+				positions.clear();
+				labels.clear();
+			};
+			for(auto&& entry: range) {
+				const auto& [position, label] = entry;
+				positions.push_back(position);
+				labels.push_back(label);
+				if(positions.size() == BlockSize) {
+					flush();
+				}
+			}
+			flush();
+			return result;
+		}
+
+		/*
+		 * puts the input vectors into the order of the tree's entries. the tree reorders its entries, so both are
+		 * sorted by coordinates and label and matched in that order; entries that compare equal are
+		 * indistinguishable to the tree, so any of their input vectors may go to any of them
+		 */
+		void attachOriginals(const TrainingSet& trainingSet) {
+			if constexpr(not SupportsReranking) {
+				throw std::invalid_argument("re-ranking needs an index with leaf access (KDTree)");
+			} else if constexpr(not std::totally_ordered<TLabel>) {
+				throw std::invalid_argument("re-ranking needs totally ordered labels");
+			} else {
+				auto treeEntries = kdTree_.entries();
+				if(treeEntries.size() != trainingSet.entries.size()) {
+					throw std::logic_error("the tree does not hold every training entry");
+				}
+				auto entryLess = [](const TreeEntryType& a, const TreeEntryType& b) {
+					for(int axis=0; axis<NTreeDims; axis++) {
+						if(a.coord[axis] != b.coord[axis]) {
+							return a.coord[axis] < b.coord[axis];
+						}
+					}
+					return a.label < b.label;
+				};
+				std::vector<uint32_t> inputOrder(treeEntries.size()), treeOrder(treeEntries.size());
+				std::iota(inputOrder.begin(), inputOrder.end(), uint32_t(0));
+				std::iota(treeOrder.begin(), treeOrder.end(), uint32_t(0));
+				std::ranges::sort(inputOrder, entryLess, [&](uint32_t i) -> const TreeEntryType& { return trainingSet.entries[i]; });
+				std::ranges::sort(treeOrder, entryLess, [&](uint32_t i) -> const TreeEntryType& { return treeEntries[i]; });
+				originals_.resize(treeEntries.size());
+				for(size_t i=0; i<treeOrder.size(); i++) {
+					originals_[treeOrder[i]] = trainingSet.originals[inputOrder[i]];
+				}
+			}
+		}
+
+		using TreePointType = typename TreeType::IndexType;
+		using TreeEntryType = typename TreeType::EntryType;
+		using CandidateType = detail::KNNCandidate<TLabel>;
+		using SoADistanceType = detail::SoADistanceType<TCoord>;
+
+		/*
+		 * reduces `points` into `out`, in one call if the reducer can project a batch at once
+		 */
+		static void reduceBatch(const DimensionalityReducerType& dimensionalityReducer, std::span<const PointType> points, std::span<TreePointType> out) {
+			if constexpr(requires { dimensionalityReducer.reduceBatch(points, out); }) {
+				dimensionalityReducer.reduceBatch(points, out);
+			} else {
+				for(size_t i=0; i<points.size(); i++) {
+					out[i] = dimensionalityReducer.reduce(points[i]);
+				}
+			}
+		}
+
+		/*
+		 * reduces a query batch in chunks on the pool; without a reduction the batch is used as it is
+		 */
+		std::span<const TreePointType> reduceQueries(std::span<const PointType> points, size_t chunkSize, ThreadPool& pool, std::vector<TreePointType>& storage) const {
+			if constexpr(std::is_same_v<DimensionalityReducerType, NoDimensionalityReduction<TCoord, NDims, NTreeDims>>) {
+				return points;
+			} else {
+				storage.resize(points.size());
+				pool.parallelFor(points.size(), chunkSize, [&](size_t begin, size_t end) {
+					reduceBatch(dimensionalityReducer_, points.subspan(begin, end - begin), std::span(storage).subspan(begin, end - begin));
+				});
+				return storage;
+			}
+		}
+
+		/*
+		 * whether the index lets the search scan whole leaves (and use SoA leaves) instead of visiting single entries
+		 */
+		static constexpr bool HasLeafAccess = requires(const TreeType& tree, const TreePointType& point) {
+			tree.walkLeavesNearestFirst(point, [](const auto&) {}, [](const auto&) { return true; });
+		};
+
+		/*
+		 * whether the index searches all of its trees through one priority queue (see KDForest)
+		 */
+		static constexpr bool HasPrioritizedWalk = requires(const TreeType& tree, const TreePointType& point, QueryContext& context) {
+			tree.walkLeavesPrioritized(point, context.indexScratch, [](const TreePointType&, const TLabel&) {}, [](double, int64_t) { return true; });
+		};
+
+		static constexpr bool HasIncrementalWalk = AxisSeparableDistanceMetric<TMetric> && requires(const TreeType& tree, const TreePointType& point) {
+			tree.walkLeavesIncremental(point, [](const auto&) {}, [](double offset) { return offset; }, [](double) { return true; });
+		};
+
+		/*
+		 * whether the index can sort queries along the curve its entries are ordered by
+		 */
+		static constexpr bool HasCurveOrder = requires(const TreeType& tree, std::span<const TreePointType> points) {
+			{tree.entryOrder()} -> std::same_as<SpaceFillingCurve>;
+			tree.curveOrder(points);
+		};
+
+		/*
+		 * whether search results can be traced back to entries of the index, as re-ranking needs
+		 */
+		static constexpr bool SupportsReranking = HasLeafAccess && not HasPrioritizedWalk && requires(const TreeType& tree) {
+			{tree.entries()} -> std::convertible_to<std::span<const TreeEntryType>>;
+		};
+
+		static constexpr bool HasSoAKernel = requires(const TreePointType& point, const TCoord* coords, SoADistanceType* out) {
+			TMetric::reducedDistancesSoA(point, coords, size_t {}, size_t {}, out);
+		};
+
+		/*
+		 * the reduced distance, or some value above `bound` if it is larger than that
+		 */
+		[[nodiscard]] static double reducedDistanceWithin(const TreePointType& p1, const TreePointType& p2, double bound, int64_t& coordinatesTouched) {
+			if constexpr(BoundedDistanceMetric<TMetric>) {
+				auto result = TMetric::reducedDistanceBounded(p1, p2, bound);
+				coordinatesTouched += result.axesVisited;
+				return result.reducedDistance;
+			} else {
+				coordinatesTouched += NTreeDims;
+				return TMetric::reducedDistance(p1, p2);
+			}
+		}
+
+		/*
+		 * predict() for a point that has already been reduced, with `k` already clamped.
+		 * with `warmStart`, a best-first search starts from context.warmStart and updates it.
+		 * `inputPoint` is the point before reduction, which re-ranking needs
+		 */
+		TLabel predictReduced(
+			const TreePointType& reducedPoint,
+			QueryContext& context,
+			int k,
+			std::optional<DistanceType> initialDist,
+			std::optional<TLabel> trueLabel,
+			bool warmStart = false,
+			const PointType* inputPoint = nullptr
+		) const {
+			if(searchStrategy_ == KNNSearchStrategy::RadiusDoubling) {
+				return predictRadiusDoubling(reducedPoint, k, initialDist, trueLabel, context);
+			}
+			bool incremental = searchStrategy_ == KNNSearchStrategy::IncrementalBestFirst;
+			if constexpr(SupportsReranking) {
+				if(inputPoint && reranksCandidates()) {
+					return predictBestFirst<true>(reducedPoint, k, trueLabel, context, incremental, warmStart, inputPoint);
+				}
+			}
+			return predictBestFirst<false>(reducedPoint, k, trueLabel, context, incremental, warmStart);
+		}
+
+		/*
+		 * whether a best-first search re-ranks its candidates in the input space
+		 */
+		[[nodiscard]] bool reranksCandidates() const {
+			return SupportsReranking && searchStrategy_ != KNNSearchStrategy::RadiusDoubling
+				&& reranking_.candidateMultiplier > 0 && not originals_.empty();
+		}
+
+		/*
+		 * how many input entries an entry of the index stands for (see KDTreeBuildOptions::collapseDuplicates)
+		 */
+		[[nodiscard]] uint32_t entryWeight(const TreeEntryType& entry) const {
+			if constexpr(requires { kdTree_.entryWeight(entry); }) {
+				return kdTree_.entryWeight(entry);
+			}
+			return 1;
+		}
+
+		[[nodiscard]] int clampK(int k) const {
+			if constexpr(requires { kdTree_.totalWeight(); }) {
+				k = std::min<int64_t>(k, kdTree_.totalWeight());
+			} else {
+				k = std::min<int64_t>(k, kdTree_.numEntries());
+			}
 			if(k < 1) {
 				throw std::invalid_argument("k must be positive");
 			}
+			return k;
+		}
 
+		/*
+		 * guesses a search radius, collects every entry within it and doubles the radius
+		 * until at least k entries have been found.
+		 * the radius is kept as a true distance and converted to a reduced one for every pass
+		 */
+		TLabel predictRadiusDoubling(
+			const TreePointType& reducedPoint,
+			int k,
+			std::optional<DistanceType> initialDist,
+			std::optional<TLabel> trueLabel,
+			QueryContext& context
+		) const {
 			static constexpr double Epsilon = 1e-6;
 
-			TDistance searchRadius = Epsilon;
-			if(defaultSearchRadius < std::numeric_limits<double>::max()) {
-				searchRadius = defaultSearchRadius;
+			DistanceType searchRadius = Epsilon;
+			if(context.defaultSearchRadius < std::numeric_limits<double>::max()) {
+				searchRadius = context.defaultSearchRadius;
 			}
 			if(initialDist) {
 				searchRadius = *initialDist;
@@ -140,95 +855,311 @@ namespace iui {
 					throw std::runtime_error("cannot find any viable points (is the metric's predicate broken?)");
 				}
 
-				struct Candidate {
-					DistanceType distance;
-					TLabel label;
-				};
-				std::vector<Candidate> candidates;
-				double totalDist = 0.0;
+				auto& candidates = context.candidates;
+				candidates.clear();
+				double totalReducedDist = 0.0;
 				int64_t entriesVisited = 0;
+				const double reducedSearchRadius = TMetric::toReducedDistance(searchRadius);
 
 				kdTree_.walk(
-					[&](const TEntry& entry) {
+					[&](const TreeEntryType& entry) {
 						entriesVisited++;
-						auto distance = TMetric::distance(reducedPoint, entry.coord);
-						totalDist += distance;
-						if(distance < searchRadius) {
-							candidates.push_back({distance, entry.label});
+						auto reducedDistance = reducedDistanceWithin(reducedPoint, entry.coord, reducedSearchRadius, context.stats.coordinatesTouched);
+						totalReducedDist += reducedDistance;
+						if(reducedDistance < reducedSearchRadius) {
+							for(uint32_t i=0; i<entryWeight(entry) && i<uint32_t(k); i++) {
+								candidates.push_back({reducedDistance, entry.label});
+							}
 						}
 					},
 					[&](auto&& hbox) {
-						return TMetric::intersectsSearchSpace(hbox, reducedPoint, searchRadius);
+						return TMetric::intersectsSearchSpaceReduced(hbox, reducedPoint, reducedSearchRadius);
 					}
 				);
-				auto averageDistance = divOrZero(totalDist, entriesVisited);
+				/* entries outside the radius only contribute the partial sum that took them past it */
+				auto averageDistance = TMetric::fromReducedDistance(divOrZero(totalReducedDist, entriesVisited));
 
 				if(candidates.size() < k) {
 					searchRadius = std::max(searchRadius * 2.0, averageDistance);
 					continue;
 				}
 
-
-
-				std::partial_sort(
-					candidates.begin(),
-					candidates.begin()+k,
-					candidates.end(),
-					[](const Candidate& a, const Candidate& b) {
-						return a.distance < b.distance;
-					}
-				);
-				candidates.resize(k);
+				std::partial_sort(candidates.begin(), candidates.begin()+k, candidates.end());
 
 				double maxCandDist = 0.0;
 				for(int i=0; i<k; i++) {
 					maxCandDist = std::max(maxCandDist, candidates[i].distance);
 				}
+				maxCandDist = TMetric::fromReducedDistance(maxCandDist);
 				if(maxCandDist > Epsilon) {
-					defaultSearchRadius = maxCandDist * 2.0;
+					context.defaultSearchRadius = maxCandDist * 2.0;
 				}
 
-				std::map<TLabel, detail::LabelScore<TLabel>> labelScoresMap;
-				for(auto& cand: candidates) {
-					detail::LabelScore<TLabel>& score = labelScoresMap[cand.label];
-					score.frequency += 1;
-					score.negTotalDistance -= cand.distance;
-					score.label = cand.label;
+				return voteAndRecord(std::span(candidates).first(k), entriesVisited, trueLabel, context);
+			}
+		}
+
+		/*
+		 * single-pass branch-and-bound search: keeps the k best candidates in a bounded max-heap,
+		 * descends into the nearer child first and prunes with the current k-th distance,
+		 * shrunk according to the classifier's KNNApproximation. candidates are ranked by reduced distance.
+		 * the leaf budget only applies to indexes with leaf access; for a KDForest it is shared by all trees.
+		 * a warm start scans the previous query's first leaf before walking the tree, and bounds the search
+		 * by the previous k-th distance plus the distance between the two queries until k candidates are found.
+		 * with `Rerank`, the search collects k * candidateMultiplier entry indices instead of labels,
+		 * and rerankAndVote() picks the k nearest of them by their input vectors
+		 */
+		template<bool Rerank>
+		TLabel predictBestFirst(
+			const TreePointType& reducedPoint,
+			int k,
+			std::optional<TLabel> trueLabel,
+			QueryContext& context,
+			bool incremental,
+			bool warmStart = false,
+			const PointType* inputPoint = nullptr
+		) const {
+			auto& nearest = [&]() -> auto& {
+				if constexpr(Rerank) {
+					return context.entryNearest;
+				} else {
+					return context.nearest;
 				}
-				auto bestScore = std::max_element(
-					labelScoresMap.begin(),
-					labelScoresMap.end(),
-					labelScoresMap.value_comp()
-				);
+			}();
+			if constexpr(Rerank) {
+				nearest.reset(int(std::min<int64_t>(int64_t(k) * reranking_.candidateMultiplier, kdTree_.numEntries())));
+			} else {
+				nearest.reset(k);
+			}
+			/* what the search keeps of an entry: its label, or its index for re-ranking */
+			auto keyOf = [](const TLabel& label, size_t entryIndex) -> decltype(auto) {
+				if constexpr(Rerank) {
+					return uint32_t(entryIndex);
+				} else {
+					return (label);
+				}
+			};
+			int64_t entriesVisited = 0;
+			int64_t leavesVisited = 0;
+			bool truncated = false;
 
-				TLabel result = bestScore->second.label;
+			WarmStart& warm = context.warmStart;
+			double warmBound = std::numeric_limits<double>::infinity();
+			if(warmStart && warm.valid && std::isfinite(warm.kthDistance)) {
+				/* the previous query's k neighbors are all within this distance of the current one */
+				warmBound = TMetric::toReducedDistance(warm.kthDistance + TMetric::distance(warm.point, reducedPoint));
+			}
+			int64_t skippedLeaf = -1;
+			int64_t firstLeaf = -1;
 
-				stats.pointsConsidered += kdTree_.numEntries();
-				stats.pointsSkipped += kdTree_.numEntries() - entriesVisited;
+			const double boundScale = 1.0 / (1.0 + approximation_.epsilon);
+			const int64_t maxLeavesVisited = approximation_.maxLeavesVisited.value_or(std::numeric_limits<int64_t>::max());
 
-				if(trueLabel.has_value()) {
-					stats.totalPredictions += 1;
-					stats.accuratePredictions += result == trueLabel.value();
+			/*
+			 * decides whether to enter a subtree; `isWithin` is given the reduced k-th distance,
+			 * shrunk by boundScale in true distance
+			 */
+			auto shouldEnter = [&](auto&& isWithin) {
+				double bound = nearest.worstDistance();
+				if(std::isinf(bound)) {
+					return std::isinf(warmBound) || isWithin(warmBound);
 				}
+				if(leavesVisited >= maxLeavesVisited) {
+					truncated = true;
+					return false;
+				}
+				if(boundScale != 1.0) {
+					bound = TMetric::toReducedDistance(TMetric::fromReducedDistance(bound) * boundScale);
+				}
+				/* a subtree right at the k-th distance cannot hold a closer entry, which prunes runs of duplicates */
+				return isWithin(std::nextafter(bound, -std::numeric_limits<double>::infinity()));
+			};
 
-				return result;
+			auto hboxPredicate = [&](auto&& hbox) {
+				return shouldEnter([&](double bound) {
+					return TMetric::intersectsSearchSpaceReduced(hbox, reducedPoint, bound);
+				});
+			};
+
+			auto scanLeafEntries = [&](const auto& leaf) {
+				if constexpr(HasLeafAccess) {
+					leavesVisited++;
+					if constexpr(HasSoAKernel) {
+						if(kdTree_.hasSoALeaves()) {
+							auto soaLeaf = kdTree_.soaLeaf(leaf);
+							context.leafDistances.resize(soaLeaf.size);
+							TMetric::reducedDistancesSoA(reducedPoint, soaLeaf.coords, soaLeaf.axisStride, soaLeaf.size, context.leafDistances.data());
+							if(soaLeaf.weights) {
+								for(size_t i=0; i<soaLeaf.size; i++) {
+									nearest.offer(context.leafDistances[i], keyOf(soaLeaf.labels[i], leaf.firstEntry + i), soaLeaf.weights[i]);
+								}
+							} else {
+								for(size_t i=0; i<soaLeaf.size; i++) {
+									nearest.offer(context.leafDistances[i], keyOf(soaLeaf.labels[i], leaf.firstEntry + i));
+								}
+							}
+							entriesVisited += soaLeaf.size;
+							context.stats.coordinatesTouched += int64_t(soaLeaf.size) * NTreeDims;
+							return;
+						}
+					}
+					for(const auto& entry: kdTree_.leafEntries(leaf)) {
+						entriesVisited++;
+						double distance = reducedDistanceWithin(reducedPoint, entry.coord, nearest.worstDistance(), context.stats.coordinatesTouched);
+						nearest.offer(distance, keyOf(entry.label, &entry - kdTree_.entries().data()), entryWeight(entry));
+					}
+				}
+			};
+
+			auto scanLeaf = [&](const auto& leaf) {
+				if constexpr(HasLeafAccess) {
+					int64_t leafIndex = &leaf - kdTree_.nodes().data();
+					if(firstLeaf < 0) {
+						firstLeaf = leafIndex;
+					}
+					if(leafIndex == skippedLeaf) {
+						return;
+					}
+				}
+				scanLeafEntries(leaf);
+			};
+
+			if constexpr(HasLeafAccess) {
+				if(warmStart && warm.valid && warm.leafIndex >= 0) {
+					scanLeafEntries(kdTree_.nodes()[warm.leafIndex]);
+					skippedLeaf = warm.leafIndex;
+				}
 			}
 
+			if constexpr(HasPrioritizedWalk) {
+				leavesVisited = kdTree_.walkLeavesPrioritized(
+					reducedPoint,
+					context.indexScratch,
+					[&](const TreePointType& coord, const TLabel& label) {
+						entriesVisited++;
+						nearest.offer(reducedDistanceWithin(reducedPoint, coord, nearest.worstDistance(), context.stats.coordinatesTouched), label);
+					},
+					[&](double lowerBound, int64_t leavesSoFar) {
+						leavesVisited = leavesSoFar;
+						return shouldEnter([&](double bound) {
+							return TMetric::toReducedDistance(lowerBound) <= bound;
+						});
+					}
+				);
+			} else if constexpr(not HasLeafAccess) {
+				kdTree_.walkNearestFirst(
+					reducedPoint,
+					[&](const TreeEntryType& entry) {
+						entriesVisited++;
+						nearest.offer(reducedDistanceWithin(reducedPoint, entry.coord, nearest.worstDistance(), context.stats.coordinatesTouched), entry.label);
+					},
+					hboxPredicate
+				);
+			} else if constexpr(HasIncrementalWalk) {
+				if(incremental) {
+					kdTree_.walkLeavesIncremental(
+						reducedPoint,
+						scanLeaf,
+						[](double offset) {
+							return TMetric::reducedAxisDistance(offset);
+						},
+						[&](double cellDistance) {
+							return shouldEnter([&](double bound) {
+								return cellDistance <= bound;
+							});
+						}
+					);
+				} else {
+					kdTree_.walkLeavesNearestFirst(reducedPoint, scanLeaf, hboxPredicate);
+				}
+			} else {
+				kdTree_.walkLeavesNearestFirst(reducedPoint, scanLeaf, hboxPredicate);
+			}
+
+			context.stats.leavesVisited += leavesVisited;
+			context.stats.searchesTruncated += truncated;
+			TLabel result;
+			if constexpr(Rerank) {
+				result = rerankAndVote(*inputPoint, k, entriesVisited, trueLabel, context);
+			} else {
+				result = voteAndRecord(nearest.candidates(), entriesVisited, trueLabel, context);
+			}
+			if(warmStart) {
+				warm = WarmStart {
+					.valid = true,
+					.point = reducedPoint,
+					.kthDistance = TMetric::fromReducedDistance(nearest.worstDistance()),
+					.leafIndex = firstLeaf
+				};
+			}
+			return result;
 		}
 
-		[[nodiscard]] const KNNClassifierStats& getStats() const {
-			return stats;
+		/*
+		 * the second stage of re-ranking: the reduced distances of context.entryNearest's candidates are replaced by the
+		 * distances between the input vectors, and the k nearest of them vote
+		 */
+		TLabel rerankAndVote(
+			const PointType& inputPoint,
+			int k,
+			int64_t entriesVisited,
+			std::optional<TLabel> trueLabel,
+			QueryContext& context
+		) const {
+			auto& candidates = context.candidates;
+			candidates.clear();
+			for(const auto& cand: context.entryNearest.candidates()) {
+				candidates.push_back({TMetric::reducedDistance(inputPoint, originals_[cand.label]), kdTree_.entries()[cand.label].label});
+			}
+			size_t numNearest = std::min(candidates.size(), size_t(k));
+			std::partial_sort(candidates.begin(), candidates.begin() + numNearest, candidates.end());
+			return voteAndRecord(std::span(candidates).first(numNearest), entriesVisited, trueLabel, context);
 		}
 
-		void resetStats() {
-			stats = {};
+		/*
+		 * converts the k candidates' reduced distances back to true ones for weighting the vote
+		 */
+		TLabel voteAndRecord(
+			std::span<const CandidateType> candidates,
+			int64_t entriesVisited,
+			std::optional<TLabel> trueLabel,
+			QueryContext& context
+		) const {
+			auto& labelScores = context.labelScores;
+			labelScores.clear();
+			for(auto& cand: candidates) {
+				auto score = std::ranges::find(labelScores, cand.label, &detail::LabelScore<TLabel>::label);
+				if(score == labelScores.end()) {
+					score = labelScores.insert(score, detail::LabelScore<TLabel> {.label = cand.label});
+				}
+				score->frequency += 1;
+				score->negTotalDistance -= TMetric::fromReducedDistance(cand.distance);
+			}
+			auto bestScore = std::max_element(labelScores.begin(), labelScores.end());
+
+			TLabel result = bestScore->label;
+			recordPrediction(result, entriesVisited, trueLabel, context);
+			return result;
 		}
 
-	private:
-		double defaultSearchRadius = std::numeric_limits<double>::max();
-		KNNClassifierStats stats;
+		void recordPrediction(const TLabel& result, int64_t entriesVisited, std::optional<TLabel> trueLabel, QueryContext& context) const {
+			context.stats.pointsConsidered += kdTree_.numEntries();
+			context.stats.pointsSkipped += kdTree_.numEntries() - entriesVisited;
+
+			if(trueLabel.has_value()) {
+				context.stats.totalPredictions += 1;
+				context.stats.accuratePredictions += result == trueLabel.value();
+			}
+		}
+
+		KNNSearchStrategy searchStrategy_ = KNNSearchStrategy::IncrementalBestFirst;
+		KNNApproximation approximation_;
+		KNNReranking reranking_;
+		QueryContext defaultContext_;
 		DimensionalityReducerType dimensionalityReducer_;
-		KDTree<TLabel, NTreeDims, TCoord> kdTree_;
+		TreeType kdTree_;
+		/* the input vectors in the order of the tree's entries, if the classifier re-ranks */
+		std::vector<PointType> originals_;
 	};
 
 
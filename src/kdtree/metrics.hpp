@@ -3,15 +3,54 @@
 #define METRICS_HPP
 
 #include "hyperbox.hpp"
+#include "kernels.hpp"
 #include <cmath>
+#include <concepts>
 
 namespace iui {
 
+	/*
+	 * the reduced distance is any cheaper function that orders point pairs the same way as the distance
+	 * (e.g. the squared euclidean distance). searches compare reduced distances only
+	 * and convert between the two for radii and results.
+	 */
 	template<typename T>
 	concept DistanceMetric = requires
 	{
 		{T::distance(Vec3f{}, Vec3f{})};
 		{T::intersectsSearchSpace(Hyperbox<float, 3>{}, Vec3f{}, 0.0)};
+		{T::reducedDistance(Vec3f{}, Vec3f{})} -> std::convertible_to<double>;
+		{T::toReducedDistance(0.0)} -> std::convertible_to<double>;
+		{T::fromReducedDistance(0.0)} -> std::convertible_to<double>;
+		{T::intersectsSearchSpaceReduced(Hyperbox<float, 3>{}, Vec3f{}, 0.0)} -> std::convertible_to<bool>;
+	};
+
+	/*
+	 * a metric whose reduced distance is a sum of per-axis terms, which lets a traversal
+	 * update the distance to a cell one axis at a time
+	 */
+	template<typename T>
+	concept AxisSeparableDistanceMetric = DistanceMetric<T> && requires
+	{
+		{T::reducedAxisDistance(0.0)} -> std::convertible_to<double>;
+	};
+
+	/*
+	 * the result of a distance evaluation that may stop early;
+	 * `reducedDistance` is only exact if it does not exceed the bound the evaluation was given
+	 */
+	struct BoundedDistance {
+		double reducedDistance;
+		int axesVisited;
+	};
+
+	/*
+	 * a metric that can stop summing up a reduced distance once it exceeds a bound
+	 */
+	template<typename T>
+	concept BoundedDistanceMetric = DistanceMetric<T> && requires
+	{
+		{T::reducedDistanceBounded(Vec3f{}, Vec3f{}, 0.0)} -> std::same_as<BoundedDistance>;
 	};
 
 	namespace detail {
@@ -55,6 +94,12 @@ namespace iui {
 			}
 		}
 
+		/*
+		 * float coordinates are scanned in float lanes, everything else in double lanes
+		 */
+		template<typename TCoord>
+		using SoADistanceType = std::conditional_t<std::is_same_v<TCoord, float>, float, double>;
+
 	}
 
 
@@ -64,16 +109,147 @@ namespace iui {
 
 		template<typename TCoord, int NDims>
 		[[nodiscard]] static double distance(const Vec<TCoord, NDims>& p1, const Vec<TCoord, NDims>& p2) {
+			return fromReducedDistance(reducedDistance(p1, p2));
+		}
+
+		/*
+		 * long float, int32 and uint8 vectors go through the vectorized kernels in kernels.hpp
+		 */
+		template<typename TCoord, int NDims>
+		static constexpr bool UsesVectorKernel =
+			   (N == 1 || N == 2)
+			&& detail::HasMinkowskiKernel<TCoord>
+			&& NDims >= detail::MinkowskiKernelMinDims
+			&& size_t(NDims) <= detail::MinkowskiKernelMaxLength
+			&& Vec<TCoord, NDims>::IsContiguous;
+
+		/*
+		 * the sum of |p2[i] - p1[i]|^N, without the final root
+		 */
+		template<typename TCoord, int NDims>
+		[[nodiscard]] static double reducedDistance(const Vec<TCoord, NDims>& p1, const Vec<TCoord, NDims>& p2) {
+			if constexpr(UsesVectorKernel<TCoord, NDims>) {
+				return detail::MinkowskiKernel<N, TCoord>::reduced(&p1[0], &p2[0], NDims);
+			}
 			double result = 0.0;
 			(p2 - p1).forEach([&](auto v) {
 				result += detail::constAbsPow<N>(v);
 			});
-			return detail::constRoot<N>(result);
+			return result;
+		}
+
+		/*
+		 * sums up axes in fixed-size chunks and stops after the first chunk that takes the sum past `bound`,
+		 * so the inner loop stays vectorizable
+		 */
+		template<typename TCoord, int NDims>
+		[[nodiscard]] static BoundedDistance reducedDistanceBounded(const Vec<TCoord, NDims>& p1, const Vec<TCoord, NDims>& p2, double bound) {
+			if constexpr(UsesVectorKernel<TCoord, NDims>) {
+				static constexpr int KernelChunkSize = 64;
+				double result = 0.0;
+				for(int axis = 0; axis < NDims; axis += KernelChunkSize) {
+					int chunk = std::min(KernelChunkSize, NDims - axis);
+					result += detail::MinkowskiKernel<N, TCoord>::reduced(&p1[axis], &p2[axis], chunk);
+					if(result > bound) {
+						return {result, axis + chunk};
+					}
+				}
+				return {result, NDims};
+			}
+			static constexpr int ChunkSize = 16;
+			double result = 0.0;
+			int axis = 0;
+			for(; axis + ChunkSize <= NDims; axis += ChunkSize) {
+				double chunk = 0.0;
+				for(int i=0; i<ChunkSize; i++) {
+					chunk += detail::constAbsPow<N>(p2[axis + i] - p1[axis + i]);
+				}
+				result += chunk;
+				if(result > bound) {
+					return {result, axis + ChunkSize};
+				}
+			}
+			for(; axis < NDims; axis++) {
+				result += detail::constAbsPow<N>(p2[axis] - p1[axis]);
+			}
+			return {result, NDims};
+		}
+
+		[[nodiscard]] static double reducedAxisDistance(double offset) {
+			return detail::constAbsPow<N>(offset);
+		}
+
+		[[nodiscard]] static double toReducedDistance(double distance) {
+			return detail::constAbsPow<N>(distance);
+		}
+
+		[[nodiscard]] static double fromReducedDistance(double reducedDistance) {
+			return detail::constRoot<N>(reducedDistance);
+		}
+
+		/*
+		 * computes the distances from `point` to `count` points stored axis by axis:
+		 * coordinate `axis` of point `i` is at coords[axis * axisStride + i]
+		 */
+		template<typename TCoord, int NDims>
+		static void distancesSoA(
+			const Vec<TCoord, NDims>& point,
+			const TCoord* coords,
+			size_t axisStride,
+			size_t count,
+			detail::SoADistanceType<TCoord>* out
+		) {
+			reducedDistancesSoA(point, coords, axisStride, count, out);
+			for(size_t i=0; i<count; i++) {
+				out[i] = fromReducedDistance(out[i]);
+			}
+		}
+
+		/*
+		 * like distancesSoA(), but writes reduced distances
+		 */
+		template<typename TCoord, int NDims>
+		static void reducedDistancesSoA(
+			const Vec<TCoord, NDims>& point,
+			const TCoord* coords,
+			size_t axisStride,
+			size_t count,
+			detail::SoADistanceType<TCoord>* out
+		) {
+			detail::dispatchSimd([&]() IUI_ALWAYS_INLINE {
+				accumulateAxesSoA(point, coords, axisStride, count, out);
+			});
 		}
 
 		template<typename TCoord, int NDims>
 		[[nodiscard]] static bool intersectsSearchSpace(const Hyperbox<TCoord, NDims>& hbox, const Vec<TCoord, NDims>& point, double maxDist) {
-			double dist = detail::constAbsPow<N>(maxDist);
+			return intersectsSearchSpaceReduced(hbox, point, toReducedDistance(maxDist));
+		}
+
+		/*
+		 * long boxes are tested without branches, so that the loop can be vectorized for the active instruction set
+		 */
+		template<typename TCoord, int NDims>
+		[[nodiscard]] static bool intersectsSearchSpaceReduced(const Hyperbox<TCoord, NDims>& hbox, const Vec<TCoord, NDims>& point, double maxReducedDist) {
+			if constexpr(NDims >= detail::MinkowskiKernelMinDims && Vec<TCoord, NDims>::IsContiguous) {
+				using TDiff = std::conditional_t<std::is_floating_point_v<TCoord>, TCoord, double>;
+				const TCoord* p = &point[0];
+				const TCoord* lower = &hbox.pos0[0];
+				const TCoord* upper = &hbox.pos1[0];
+				double dist = 0.0;
+				detail::dispatchSimd([&]() IUI_ALWAYS_INLINE {
+					double sum = 0.0;
+					for(int i=0; i<NDims; i++) {
+						TDiff below = TDiff(lower[i]) - TDiff(p[i]);
+						TDiff above = TDiff(p[i]) - TDiff(upper[i]);
+						TDiff gap = (below > 0 ? below : TDiff(0)) + (above > 0 ? above : TDiff(0));
+						sum += detail::constAbsPow<N>(double(gap));
+					}
+					dist = sum;
+				});
+				return dist <= maxReducedDist;
+			}
+			double dist = maxReducedDist;
 			for(int i=0; i<NDims; i++) {
 				if(point[i] < hbox.pos0[i])
 					dist -= detail::constAbsPow<N>(point[i] - hbox.pos0[i]);
@@ -82,6 +258,31 @@ namespace iui {
 			}
 			return dist >= 0;
 		}
+
+	private:
+		/*
+		 * the body of reducedDistancesSoA(), inlined into each instruction set's copy; the axis loops
+		 * over contiguous rows vectorize for any leaf size
+		 */
+		template<typename TCoord, int NDims, typename TDist>
+		IUI_ALWAYS_INLINE static void accumulateAxesSoA(
+			const Vec<TCoord, NDims>& point,
+			const TCoord* __restrict coords,
+			size_t axisStride,
+			size_t count,
+			TDist* __restrict out
+		) {
+			for(size_t j=0; j<count; j++) {
+				out[j] = 0;
+			}
+			for(int axis=0; axis<NDims; axis++) {
+				const TCoord* axisCoords = coords + axis * axisStride;
+				TDist p = point[axis];
+				for(size_t j=0; j<count; j++) {
+					out[j] += detail::constAbsPow<N>(TDist(axisCoords[j]) - p);
+				}
+			}
+		}
 	};
 
 	using ManhattanDistanceMetric = MinkowskiDistanceMetric<1>;
@@ -1,12 +1,257 @@
-
 #ifndef PCA_HPP
 #define PCA_HPP
 
 #include "Vec.hpp"
-#include <eigen3/Eigen/SVD>
+#include "serialization.hpp"
+#include "kernels.hpp"
+#include <eigen3/Eigen/Eigenvalues>
+#include <eigen3/Eigen/QR>
+#include <array>
+#include <span>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <memory>
 
 namespace iui {
 
+	/*
+	 * Covariance accumulates the d x d covariance in one pass over the data and decomposes it exactly.
+	 * Randomized finds the top components by subspace iteration on the covariance without forming it
+	 * (N. Halko, P.-G. Martinsson, J. Tropp, Finding structure with randomness, SIAM Review 53, 2011):
+	 * every pass costs O(n * d * (components + oversampling)) instead of O(n * d^2), and there are
+	 * powerIterations + 2 of them, so the range must be multi-pass
+	 */
+	enum class PCASolver {
+		Covariance,
+		Randomized
+	};
+
+	struct PCAOptions {
+		PCASolver solver = PCASolver::Covariance;
+		int oversampling = 10;
+		int powerIterations = 2;
+		std::optional<uint64_t> seed;
+	};
+
+	template<typename TCoord, int NDimsSrc, int NDimsDst>
+	class PrincipalComponentAnalysis;
+
+	/*
+	 * principal components of a data set, fitted once and sliced into reducers of any dimension:
+	 * a PrincipalComponentAnalysis<TCoord, NDims, N> built from the model projects onto its first N components.
+	 * the components are sorted by decreasing variance. the data is streamed in blocks of rows,
+	 * so fitting never holds more than a block of it
+	 */
+	template<typename TCoord, int NDims>
+	class PCAModel {
+	public:
+		using InputType = Vec<TCoord, NDims>;
+
+		/*
+		 * fits `numComponents` components; the covariance solver finds all of them at the same cost
+		 */
+		explicit PCAModel(std::ranges::sized_range auto range, int numComponents = NDims, const PCAOptions& options = {}) {
+			if(numComponents < 1 || numComponents > NDims) {
+				throw std::invalid_argument(std::format("cannot fit {} components in {} dimensions", numComponents, NDims));
+			}
+			if(std::ranges::empty(range)) {
+				throw std::invalid_argument("PCA needs at least one observation");
+			}
+			/* the data is shifted by its first observation (if it can be read twice), which keeps the sums of squares small */
+			InputType shift {};
+			if constexpr(std::ranges::forward_range<decltype(range)>) {
+				shift = *std::ranges::begin(range);
+			}
+
+			Eigen::VectorXd shiftedMean;
+			if(options.solver == PCASolver::Randomized) {
+				fitRandomized(range, shift, numComponents, options, shiftedMean);
+			} else {
+				fitCovariance(range, shift, numComponents, shiftedMean);
+			}
+			mean_.resize(NDims);
+			shift.forEachEnumerated([&](int axis, auto&& v) {
+				mean_[axis] = double(v) + shiftedMean[axis];
+			});
+		}
+
+		[[nodiscard]] int numComponents() const {
+			return int(components_.cols());
+		}
+
+		/*
+		 * one component per column
+		 */
+		[[nodiscard]] const Eigen::MatrixXf& components() const {
+			return components_;
+		}
+
+		[[nodiscard]] const Eigen::VectorXd& mean() const {
+			return mean_;
+		}
+
+		/*
+		 * the variance of the data along each component
+		 */
+		[[nodiscard]] const Eigen::VectorXd& variances() const {
+			return variances_;
+		}
+
+		template<int NDimsDst>
+		[[nodiscard]] PrincipalComponentAnalysis<TCoord, NDims, NDimsDst> slice() const {
+			return PrincipalComponentAnalysis<TCoord, NDims, NDimsDst>(*this);
+		}
+
+		static constexpr detail::SerializedTypeInfo serializedTypeInfo() {
+			return detail::SerializedTypeInfo {
+				.inputDims = NDims,
+				.coordSize = sizeof(TCoord),
+				.coordKind = detail::numericKindOf<TCoord>()
+			};
+		}
+
+		/*
+		 * writes the model to a file of its own, in the same format as a saved classifier
+		 */
+		void save(const std::string& filename) const {
+			detail::BinaryWriter writer(filename, serializedTypeInfo());
+			writer.writeValue(detail::sectionTag("PCAN"), int32_t(numComponents()));
+			writer.writeSection(detail::sectionTag("PCAC"), std::span<const float>(components_.data(), components_.size()));
+			writer.writeSection(detail::sectionTag("PCAU"), std::span<const double>(mean_.data(), mean_.size()));
+			writer.writeSection(detail::sectionTag("PCAV"), std::span<const double>(variances_.data(), variances_.size()));
+			writer.finish();
+		}
+
+		[[nodiscard]] static PCAModel load(const std::string& filename, bool verifyChecksum = true) {
+			detail::BinaryReader reader(std::make_shared<const MappedFile>(filename), serializedTypeInfo(), verifyChecksum);
+			int32_t numComponents = reader.readValue<int32_t>(detail::sectionTag("PCAN"));
+			auto components = reader.readSection<float>(detail::sectionTag("PCAC"));
+			auto mean = reader.readSection<double>(detail::sectionTag("PCAU"));
+			auto variances = reader.readSection<double>(detail::sectionTag("PCAV"));
+			if(numComponents < 1 || numComponents > NDims
+				|| components.size() != size_t(NDims) * numComponents
+				|| mean.size() != size_t(NDims)
+				|| variances.size() != size_t(numComponents)
+			) {
+				throw SerializationError("serialized PCA model has the wrong size");
+			}
+			PCAModel result;
+			result.components_ = Eigen::Map<const Eigen::MatrixXf>(components.data(), NDims, numComponents);
+			result.mean_ = Eigen::Map<const Eigen::VectorXd>(mean.data(), NDims);
+			result.variances_ = Eigen::Map<const Eigen::VectorXd>(variances.data(), numComponents);
+			return result;
+		}
+
+	private:
+		static constexpr int BlockRows = 256;
+
+		PCAModel() = default;
+
+		/*
+		 * calls `fn` with consecutive blocks of (observation - shift) as the rows of a matrix
+		 */
+		static void forEachBlock(auto& range, const InputType& shift, auto&& fn) {
+			Eigen::MatrixXf block(BlockRows, NDims);
+			int rows = 0;
+			for(const InputType& observation: range) {
+				observation.forEachEnumerated([&](int axis, auto&& v) {
+					block(rows, axis) = float(double(v) - double(shift[axis]));
+				});
+				if(++rows == BlockRows) {
+					fn(block);
+					rows = 0;
+				}
+			}
+			if(rows > 0) {
+				fn(block.topRows(rows));
+			}
+		}
+
+		/*
+		 * one pass: the scatter matrix of each block is added up in double precision, then centred
+		 */
+		void fitCovariance(auto& range, const InputType& shift, int numComponents, Eigen::VectorXd& shiftedMean) {
+			Eigen::MatrixXd scatter = Eigen::MatrixXd::Zero(NDims, NDims);
+			Eigen::VectorXd sum = Eigen::VectorXd::Zero(NDims);
+			Eigen::MatrixXf blockScatter(NDims, NDims);
+			double numObservations = 0.0;
+			forEachBlock(range, shift, [&](const auto& block) {
+				blockScatter.setZero();
+				blockScatter.template selfadjointView<Eigen::Lower>().rankUpdate(block.transpose());
+				scatter += blockScatter.template cast<double>();
+				sum += block.colwise().sum().transpose().template cast<double>();
+				numObservations += double(block.rows());
+			});
+			shiftedMean = sum / numObservations;
+			scatter -= numObservations * shiftedMean * shiftedMean.transpose();
+
+			/* eigenvalues come in increasing order */
+			Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eigen(scatter);
+			components_ = eigen.eigenvectors().rightCols(numComponents).rowwise().reverse().cast<float>();
+			variances_ = eigen.eigenvalues().tail(numComponents).reverse() / numObservations;
+		}
+
+		/*
+		 * subspace iteration: every pass multiplies the basis by the scatter matrix block by block,
+		 * (B^T B) Q = B^T (B Q), and the centring is subtracted afterwards. the first pass finds the range,
+		 * the last one gives the final basis' Rayleigh quotient, whose eigenvectors rotate it onto the components
+		 */
+		void fitRandomized(auto& range, const InputType& shift, int numComponents, const PCAOptions& options, Eigen::VectorXd& shiftedMean) {
+			static_assert(std::ranges::forward_range<decltype(range)>, "randomized PCA makes several passes over the data");
+			const int numColumns = std::min(NDims, numComponents + std::max(0, options.oversampling));
+
+			std::mt19937_64 random(options.seed.value_or(std::random_device{}()));
+			std::normal_distribution<double> normal;
+			Eigen::MatrixXd basis = Eigen::MatrixXd::NullaryExpr(NDims, numColumns, [&]() {
+				return normal(random);
+			});
+			basis = orthonormalize(basis);
+
+			Eigen::MatrixXd product(NDims, numColumns);
+			Eigen::MatrixXf floatBasis;
+			Eigen::VectorXd sum = Eigen::VectorXd::Zero(NDims);
+			double numObservations = 0.0;
+			const int numPasses = std::max(0, options.powerIterations) + 2;
+			for(int pass=0; pass<numPasses; pass++) {
+				product.setZero();
+				floatBasis = basis.cast<float>();
+				forEachBlock(range, shift, [&](const auto& block) {
+					product += (block.transpose() * (block * floatBasis)).template cast<double>();
+					if(pass == 0) {
+						sum += block.colwise().sum().transpose().template cast<double>();
+						numObservations += double(block.rows());
+					}
+				});
+				if(pass == 0) {
+					shiftedMean = sum / numObservations;
+				}
+				product -= numObservations * shiftedMean * (shiftedMean.transpose() * basis);
+				if(pass + 1 < numPasses) {
+					basis = orthonormalize(product);
+				}
+			}
+
+			Eigen::MatrixXd rayleigh = basis.transpose() * product;
+			Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eigen(0.5 * (rayleigh + rayleigh.transpose()));
+			components_ = (basis * eigen.eigenvectors().rightCols(numComponents).rowwise().reverse()).cast<float>();
+			variances_ = eigen.eigenvalues().tail(numComponents).reverse() / numObservations;
+		}
+
+		[[nodiscard]] static Eigen::MatrixXd orthonormalize(const Eigen::MatrixXd& columns) {
+			Eigen::HouseholderQR<Eigen::MatrixXd> qr(columns);
+			return qr.householderQ() * Eigen::MatrixXd::Identity(columns.rows(), columns.cols());
+		}
+
+		Eigen::MatrixXf components_;
+		Eigen::VectorXd mean_;
+		Eigen::VectorXd variances_;
+	};
+
+	/*
+	 * projects onto the principal components of the training data, centred on its mean
+	 */
 	template<typename TCoord, int NDimsSrc, int NDimsDst>
 	class PrincipalComponentAnalysis {
 	public:
@@ -17,39 +262,148 @@ namespace iui {
 		using OutputType = Vec<TCoord, NumOutputDims>;
 
 
-		explicit PrincipalComponentAnalysis(std::ranges::sized_range auto range) {
-
-			std::vector<InputType> observations(std::ranges::begin(range), std::ranges::end(range));
+		explicit PrincipalComponentAnalysis(std::ranges::sized_range auto range, const PCAOptions& options = {})
+			: PrincipalComponentAnalysis(PCAModel<TCoord, NumInputDims>(range, NumOutputDims, options)) {}
 
-			Eigen::MatrixXf M(observations.size(), NumInputDims);
-			for(int i=0; i<observations.size(); i++) {
-				observations[i].forEachEnumerated([&](int axis, auto&& val) {
-					M(i, axis) = val;
-				});
+		/*
+		 * the model's first NDimsDst components; not explicit, so that a model can be passed wherever a reducer is
+		 */
+		PrincipalComponentAnalysis(const PCAModel<TCoord, NumInputDims>& model) {
+			if(model.numComponents() < NumOutputDims) {
+				throw std::invalid_argument(std::format("the PCA model has {} components, {} are needed", model.numComponents(), NumOutputDims));
 			}
-			Eigen::BDCSVD<Eigen::MatrixXf> svd(M, Eigen::ComputeFullV);
-
-			pcaTransform = svd.matrixV().leftCols(NumOutputDims);
+			pcaTransform = model.components().leftCols(NumOutputDims);
+			projectedMean = (pcaTransform.cast<double>().transpose() * model.mean()).template cast<float>();
 		}
 
+		/*
+		 * the projection is a dot product with each of the transform's (contiguous) columns, compiled for every
+		 * instruction set in kernels.hpp. it is bound by reading the transform, so columns are processed
+		 * in blocks that share the loads of the input
+		 */
 		auto reduce(const InputType& input) const {
+			static constexpr int BlockColumns = 4;
 
-			Eigen::RowVectorXf inputVec(NumInputDims);
+			std::array<float, NumInputDims> inputValues;
 			input.forEachEnumerated([&](int i, auto&& v) {
-				inputVec(i) = v;
+				inputValues[i] = float(v);
+			});
+
+			std::array<float, NumOutputDims> outputValues;
+			const float* in = inputValues.data();
+			const float* columns = pcaTransform.data();
+			float* out = outputValues.data();
+			detail::dispatchSimd([&]() IUI_ALWAYS_INLINE {
+				int j = 0;
+				for(; j + BlockColumns <= NumOutputDims; j += BlockColumns) {
+					dotColumns<BlockColumns>(in, columns + size_t(j) * NumInputDims, out + j);
+				}
+				for(; j < NumOutputDims; j++) {
+					dotColumns<1>(in, columns + size_t(j) * NumInputDims, out + j);
+				}
 			});
 
-			Eigen::RowVectorXf outputVec = inputVec * pcaTransform;
 			OutputType output;
 			output.forEachEnumerated([&](int i, TCoord& v) {
-				v = outputVec(i);
+				v = outputValues[i] - projectedMean[i];
 			});
 			return output;
 		}
 
+		/*
+		 * reduce() for many points: every block of them is projected with one matrix product.
+		 * the transform is viewed as a fixed-size matrix, so the product is specialized for the dimensions.
+		 * narrow transforms stay in cache anyway and are projected point by point, which is faster for them
+		 */
+		void reduceBatch(std::span<const InputType> inputs, std::span<OutputType> outputs) const {
+			if(outputs.size() < inputs.size()) {
+				throw std::invalid_argument("output span is smaller than the batch");
+			}
+			if constexpr(NumOutputDims < MinBatchOutputDims) {
+				for(size_t i=0; i<inputs.size(); i++) {
+					outputs[i] = reduce(inputs[i]);
+				}
+				return;
+			}
+			Eigen::Map<const Eigen::Matrix<float, NumInputDims, NumOutputDims>> transform(pcaTransform.data());
+			const Eigen::Index maxColumns = Eigen::Index(std::min<size_t>(BatchBlockSize, inputs.size()));
+			/* one point per column, so that both are filled and read contiguously */
+			Eigen::Matrix<float, NumInputDims, Eigen::Dynamic> block(NumInputDims, maxColumns);
+			Eigen::Matrix<float, NumOutputDims, Eigen::Dynamic> projected(NumOutputDims, maxColumns);
+			for(size_t begin=0; begin<inputs.size(); begin+=BatchBlockSize) {
+				const Eigen::Index columns = Eigen::Index(std::min<size_t>(BatchBlockSize, inputs.size() - begin));
+				for(Eigen::Index column=0; column<columns; column++) {
+					inputs[begin + column].forEachEnumerated([&](int axis, auto&& v) {
+						block(axis, column) = float(v);
+					});
+				}
+				projected.leftCols(columns).noalias() = transform.transpose() * block.leftCols(columns);
+				for(Eigen::Index column=0; column<columns; column++) {
+					outputs[begin + column].forEachEnumerated([&](int i, TCoord& v) {
+						v = projected(i, column) - projectedMean[i];
+					});
+				}
+			}
+		}
+
+		void serialize(detail::BinaryWriter& writer) const {
+			writer.writeSection(detail::sectionTag("PCAM"), std::span<const float>(pcaTransform.data(), pcaTransform.size()));
+			writer.writeSection(detail::sectionTag("PCAO"), std::span<const float>(projectedMean.data(), projectedMean.size()));
+		}
+
+		[[nodiscard]] static PrincipalComponentAnalysis deserialize(detail::BinaryReader& reader) {
+			auto data = reader.readSection<float>(detail::sectionTag("PCAM"));
+			if(data.size() != size_t(NumInputDims) * NumOutputDims) {
+				throw SerializationError("serialized PCA projection has the wrong size");
+			}
+			auto offset = reader.readSection<float>(detail::sectionTag("PCAO"));
+			if(offset.size() != size_t(NumOutputDims)) {
+				throw SerializationError("serialized PCA offset has the wrong size");
+			}
+			PrincipalComponentAnalysis result;
+			result.pcaTransform = Eigen::Map<const Eigen::MatrixXf>(data.data(), NumInputDims, NumOutputDims);
+			result.projectedMean = Eigen::Map<const Eigen::VectorXf>(offset.data(), NumOutputDims);
+			return result;
+		}
+
 
 	private:
+		static constexpr size_t BatchBlockSize = 64;
+		static constexpr int MinBatchOutputDims = 16;
+
+		PrincipalComponentAnalysis() = default;
+
+		/*
+		 * the partial sums are kept in separate lanes, so that the loop vectorizes without reassociating float additions
+		 */
+		template<int NColumns>
+		IUI_ALWAYS_INLINE static void dotColumns(const float* __restrict in, const float* __restrict block, float* __restrict out) {
+			static constexpr int Lanes = 16;
+
+			float partial[NColumns][Lanes] = {};
+			int i = 0;
+			for(; i + Lanes <= NumInputDims; i += Lanes) {
+				for(int column=0; column<NColumns; column++) {
+					for(int lane=0; lane<Lanes; lane++) {
+						partial[column][lane] += in[i + lane] * block[column * NumInputDims + i + lane];
+					}
+				}
+			}
+			for(int column=0; column<NColumns; column++) {
+				float sum = 0.0f;
+				for(int lane=0; lane<Lanes; lane++) {
+					sum += partial[column][lane];
+				}
+				for(int k=i; k<NumInputDims; k++) {
+					sum += in[k] * block[column * NumInputDims + k];
+				}
+				out[column] = sum;
+			}
+		}
+
 		Eigen::MatrixXf pcaTransform;
+		/* the mean in component space, subtracted from every projection */
+		Eigen::VectorXf projectedMean;
 	};
 
 }
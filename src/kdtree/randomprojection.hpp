@@ -0,0 +1,155 @@
+
+#ifndef RANDOMPROJECTION_HPP
+#define RANDOMPROJECTION_HPP
+
+#include "Vec.hpp"
+#include "serialization.hpp"
+#include <array>
+#include <cmath>
+#include <format>
+#include <optional>
+#include <random>
+#include <ranges>
+#include <stdexcept>
+#include <vector>
+
+namespace iui {
+
+	/*
+	 * `density` is the fraction of non-zero entries in the projection matrix. the default 1/3 is Achlioptas'
+	 * database-friendly projection (D. Achlioptas, Database-friendly random projections, PODS 2001);
+	 * 1 / sqrt(input dimensions) is the "very sparse" projection of P. Li, T. Hastie and K. Church (KDD 2006),
+	 * which is faster and preserves distances nearly as well on data that is not itself very sparse
+	 */
+	struct RandomProjectionOptions {
+		double density = 1.0 / 3.0;
+		std::optional<uint64_t> seed;
+	};
+
+	/*
+	 * Johnson-Lindenstrauss random projection: every output is a sum of randomly chosen input coordinates with random
+	 * signs, scaled so that distances are preserved in expectation. unlike PCA it does not look at the data, so it is
+	 * fitted in O(input dimensions * output dimensions) without Eigen, and it projects a point with
+	 * density * input * output additions and no multiplications but the final scaling; zero inputs are skipped.
+	 * it keeps fewer of the distances' details than PCA at the same output dimension
+	 */
+	template<typename TCoord, int NDimsSrc, int NDimsDst>
+	class RandomProjection {
+	public:
+		static constexpr int NumInputDims = NDimsSrc;
+		static constexpr int NumOutputDims = NDimsDst;
+
+		using InputType = Vec<TCoord, NumInputDims>;
+		using OutputType = Vec<TCoord, NumOutputDims>;
+
+		explicit RandomProjection(const RandomProjectionOptions& options = {}) {
+			if(not (options.density > 0.0 && options.density <= 1.0)) {
+				throw std::invalid_argument(std::format("projection density must be in (0, 1], got {}", options.density));
+			}
+			std::mt19937_64 random(options.seed.value_or(std::random_device{}()));
+			std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+			rowOffsets_.reserve(NumInputDims + 1);
+			negativeOffsets_.reserve(NumInputDims);
+			std::vector<uint32_t> negatives;
+			for(int axis=0; axis<NumInputDims; axis++) {
+				rowOffsets_.push_back(uint32_t(columns_.size()));
+				negatives.clear();
+				for(int column=0; column<NumOutputDims; column++) {
+					double u = uniform(random);
+					if(u < 0.5 * options.density) {
+						columns_.push_back(column);
+					} else if(u < options.density) {
+						negatives.push_back(column);
+					}
+				}
+				negativeOffsets_.push_back(uint32_t(columns_.size()));
+				columns_.insert(columns_.end(), negatives.begin(), negatives.end());
+			}
+			rowOffsets_.push_back(uint32_t(columns_.size()));
+			scale_ = float(1.0 / std::sqrt(options.density * NumOutputDims));
+		}
+
+		/*
+		 * the projection does not depend on the data; this is the constructor KNNClassifier calls
+		 */
+		explicit RandomProjection(std::ranges::range auto range, const RandomProjectionOptions& options = {}) : RandomProjection(options) {}
+
+		auto reduce(const InputType& input) const {
+			std::array<float, NumOutputDims> sums {};
+			input.forEachEnumerated([&](int axis, auto&& v) {
+				float value = float(v);
+				if(value == 0.0f) {
+					return;
+				}
+				uint32_t negativeBegin = negativeOffsets_[axis];
+				for(uint32_t i=rowOffsets_[axis]; i<negativeBegin; i++) {
+					sums[columns_[i]] += value;
+				}
+				for(uint32_t i=negativeBegin; i<rowOffsets_[axis + 1]; i++) {
+					sums[columns_[i]] -= value;
+				}
+			});
+
+			OutputType output;
+			output.forEachEnumerated([&](int i, TCoord& v) {
+				v = sums[i] * scale_;
+			});
+			return output;
+		}
+
+		/*
+		 * the number of non-zero entries in the projection matrix
+		 */
+		[[nodiscard]] size_t numNonZeros() const {
+			return columns_.size();
+		}
+
+		void serialize(detail::BinaryWriter& writer) const {
+			writer.writeSection(detail::sectionTag("RPRO"), std::span<const uint32_t>(rowOffsets_));
+			writer.writeSection(detail::sectionTag("RPRN"), std::span<const uint32_t>(negativeOffsets_));
+			writer.writeSection(detail::sectionTag("RPRC"), std::span<const uint32_t>(columns_));
+			writer.writeValue(detail::sectionTag("RPRS"), scale_);
+		}
+
+		[[nodiscard]] static RandomProjection deserialize(detail::BinaryReader& reader) {
+			auto rowOffsets = reader.readSection<uint32_t>(detail::sectionTag("RPRO"));
+			auto negativeOffsets = reader.readSection<uint32_t>(detail::sectionTag("RPRN"));
+			auto columns = reader.readSection<uint32_t>(detail::sectionTag("RPRC"));
+			float scale = reader.readValue<float>(detail::sectionTag("RPRS"));
+			if(rowOffsets.size() != size_t(NumInputDims) + 1 || negativeOffsets.size() != size_t(NumInputDims)
+				|| rowOffsets.front() != 0 || rowOffsets.back() != columns.size()
+			) {
+				throw SerializationError("serialized random projection has the wrong size");
+			}
+			for(int axis=0; axis<NumInputDims; axis++) {
+				if(not (rowOffsets[axis] <= negativeOffsets[axis] && negativeOffsets[axis] <= rowOffsets[axis + 1])) {
+					throw SerializationError("serialized random projection is corrupted");
+				}
+			}
+			if(std::ranges::any_of(columns, [](uint32_t column) { return column >= uint32_t(NumOutputDims); })) {
+				throw SerializationError("serialized random projection is corrupted");
+			}
+			RandomProjection result(Uninitialized {});
+			result.rowOffsets_.assign(rowOffsets.begin(), rowOffsets.end());
+			result.negativeOffsets_.assign(negativeOffsets.begin(), negativeOffsets.end());
+			result.columns_.assign(columns.begin(), columns.end());
+			result.scale_ = scale;
+			return result;
+		}
+
+	private:
+		struct Uninitialized {};
+
+		explicit RandomProjection(Uninitialized) {}
+
+		/* the non-zeros of input axis i are columns_[rowOffsets_[i], rowOffsets_[i + 1]), the positive ones first */
+		std::vector<uint32_t> rowOffsets_;
+		std::vector<uint32_t> negativeOffsets_;
+		std::vector<uint32_t> columns_;
+		float scale_ = 1.0f;
+	};
+
+}
+
+#endif //RANDOMPROJECTION_HPP
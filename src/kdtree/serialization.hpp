@@ -0,0 +1,358 @@
+
+#ifndef SERIALIZATION_HPP
+#define SERIALIZATION_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace iui {
+
+	class SerializationError: public std::runtime_error {
+	public:
+		using std::runtime_error::runtime_error;
+	};
+
+	/*
+	 * a read-only view of a whole file, mapped into memory
+	 */
+	class MappedFile {
+	public:
+		explicit MappedFile(const std::string& filename) {
+#ifdef _WIN32
+			file_ = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if(file_ == INVALID_HANDLE_VALUE) {
+				throw SerializationError(std::format("no such file: {}", filename));
+			}
+			LARGE_INTEGER fileSize;
+			GetFileSizeEx(file_, &fileSize);
+			size_ = fileSize.QuadPart;
+			if(size_ > 0) {
+				mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+				if(not mapping_) {
+					CloseHandle(file_);
+					throw SerializationError(std::format("cannot map file: {}", filename));
+				}
+				data_ = MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+				if(not data_) {
+					CloseHandle(mapping_);
+					CloseHandle(file_);
+					throw SerializationError(std::format("cannot map file: {}", filename));
+				}
+			}
+#else
+			int fd = ::open(filename.c_str(), O_RDONLY);
+			if(fd < 0) {
+				throw SerializationError(std::format("no such file: {}", filename));
+			}
+			struct stat fileStat {};
+			if(::fstat(fd, &fileStat) != 0) {
+				::close(fd);
+				throw SerializationError(std::format("cannot stat file: {}", filename));
+			}
+			size_ = fileStat.st_size;
+			if(size_ > 0) {
+				void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+				if(data == MAP_FAILED) {
+					::close(fd);
+					throw SerializationError(std::format("cannot map file: {}", filename));
+				}
+				data_ = data;
+			}
+			::close(fd);
+#endif
+		}
+
+		~MappedFile() {
+#ifdef _WIN32
+			if(data_) {
+				UnmapViewOfFile(data_);
+			}
+			if(mapping_) {
+				CloseHandle(mapping_);
+			}
+			CloseHandle(file_);
+#else
+			if(data_) {
+				::munmap(data_, size_);
+			}
+#endif
+		}
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		[[nodiscard]] std::span<const std::byte> bytes() const {
+			return {static_cast<const std::byte*>(data_), size_};
+		}
+
+	private:
+#ifdef _WIN32
+		HANDLE file_ = INVALID_HANDLE_VALUE;
+		HANDLE mapping_ = nullptr;
+#endif
+		void* data_ = nullptr;
+		size_t size_ = 0;
+	};
+
+	namespace detail {
+
+		inline constexpr std::array<char, 8> SerializationMagic = {'I', 'U', 'I', 'K', 'D', 'T', 'R', 'E'};
+		inline constexpr uint32_t SerializationVersion = 6;
+		inline constexpr uint32_t EndiannessMarker = 0x01020304;
+		inline constexpr size_t SectionAlignment = 64;
+
+		constexpr uint32_t sectionTag(const char (&name)[5]) {
+			return uint32_t(uint8_t(name[0]))
+				| uint32_t(uint8_t(name[1])) << 8
+				| uint32_t(uint8_t(name[2])) << 16
+				| uint32_t(uint8_t(name[3])) << 24;
+		}
+
+		enum class NumericKind: uint32_t {
+			Other,
+			SignedInteger,
+			UnsignedInteger,
+			FloatingPoint
+		};
+
+		template<typename T>
+		constexpr NumericKind numericKindOf() {
+			if constexpr(std::is_floating_point_v<T>) {
+				return NumericKind::FloatingPoint;
+			} else if constexpr(std::is_integral_v<T> && std::is_signed_v<T>) {
+				return NumericKind::SignedInteger;
+			} else if constexpr(std::is_integral_v<T>) {
+				return NumericKind::UnsignedInteger;
+			} else {
+				return NumericKind::Other;
+			}
+		}
+
+		/*
+		 * describes the types a file was written with; a file is only loaded into the exact same types
+		 */
+		struct SerializedTypeInfo {
+			int32_t inputDims = 0;
+			int32_t treeDims = 0;
+			uint32_t coordSize = 0;
+			NumericKind coordKind = NumericKind::Other;
+			uint32_t labelSize = 0;
+			NumericKind labelKind = NumericKind::Other;
+			uint32_t entrySize = 0;
+			uint32_t nodeSize = 0;
+
+			friend bool operator==(const SerializedTypeInfo&, const SerializedTypeInfo&) = default;
+		};
+
+		struct FileHeader {
+			std::array<char, 8> magic;
+			uint32_t version;
+			uint32_t endianness;
+			SerializedTypeInfo typeInfo;
+			uint64_t payloadSize;
+			uint64_t checksum;
+		};
+
+		struct SectionHeader {
+			uint32_t tag;
+			uint32_t elementSize;
+			uint64_t count;
+		};
+
+		inline constexpr size_t alignUp(size_t value, size_t alignment) {
+			return (value + alignment - 1) / alignment * alignment;
+		}
+
+		inline constexpr size_t HeaderBlockSize = alignUp(sizeof(FileHeader), SectionAlignment);
+		inline constexpr size_t SectionHeaderBlockSize = alignUp(sizeof(SectionHeader), SectionAlignment);
+
+		/*
+		 * 64-bit FNV-1a over the payload
+		 */
+		class Checksum {
+		public:
+			void update(std::span<const std::byte> bytes) {
+				for(std::byte b: bytes) {
+					state_ = (state_ ^ uint64_t(b)) * 0x100000001B3ull;
+				}
+			}
+
+			[[nodiscard]] uint64_t value() const {
+				return state_;
+			}
+
+		private:
+			uint64_t state_ = 0xCBF29CE484222325ull;
+		};
+
+		/*
+		 * writes a header followed by a sequence of tagged, 64-byte aligned sections
+		 */
+		class BinaryWriter {
+		public:
+			BinaryWriter(const std::string& filename, const SerializedTypeInfo& typeInfo)
+				: os_(filename, std::ios::binary | std::ios::trunc), typeInfo_(typeInfo)
+			{
+				if(not os_.good()) {
+					throw SerializationError(std::format("cannot open {} for writing", filename));
+				}
+				std::array<std::byte, HeaderBlockSize> placeholder {};
+				os_.write(reinterpret_cast<const char*>(placeholder.data()), placeholder.size());
+			}
+
+			template<typename T>
+				requires std::is_trivially_copyable_v<T>
+			void writeSection(uint32_t tag, std::span<const T> items) {
+				SectionHeader header {
+					.tag = tag,
+					.elementSize = sizeof(T),
+					.count = items.size()
+				};
+				std::array<std::byte, SectionHeaderBlockSize> headerBlock {};
+				std::memcpy(headerBlock.data(), &header, sizeof(header));
+				writePayload(headerBlock);
+				writePayload(std::as_bytes(items));
+				std::array<std::byte, SectionAlignment> padding {};
+				writePayload(std::span(padding).first(alignUp(items.size_bytes(), SectionAlignment) - items.size_bytes()));
+			}
+
+			template<typename T>
+			void writeValue(uint32_t tag, const T& value) {
+				writeSection(tag, std::span<const T>(&value, 1));
+			}
+
+			void finish() {
+				FileHeader header {
+					.magic = SerializationMagic,
+					.version = SerializationVersion,
+					.endianness = EndiannessMarker,
+					.typeInfo = typeInfo_,
+					.payloadSize = payloadSize_,
+					.checksum = checksum_.value()
+				};
+				os_.seekp(0);
+				os_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+				os_.flush();
+				if(not os_.good()) {
+					throw SerializationError("failed to write serialized index");
+				}
+			}
+
+		private:
+			void writePayload(std::span<const std::byte> bytes) {
+				os_.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+				checksum_.update(bytes);
+				payloadSize_ += bytes.size();
+			}
+
+			std::ofstream os_;
+			SerializedTypeInfo typeInfo_;
+			Checksum checksum_;
+			uint64_t payloadSize_ = 0;
+		};
+
+		/*
+		 * validates a mapped file and hands out its sections as spans pointing into the mapping
+		 */
+		class BinaryReader {
+		public:
+			BinaryReader(std::shared_ptr<const MappedFile> file, const SerializedTypeInfo& expectedTypeInfo, bool verifyChecksum = true)
+				: file_(std::move(file))
+			{
+				auto bytes = file_->bytes();
+				if(bytes.size() < HeaderBlockSize) {
+					throw SerializationError("file is too small to hold a serialized index");
+				}
+				FileHeader header;
+				std::memcpy(&header, bytes.data(), sizeof(header));
+				if(header.magic != SerializationMagic) {
+					throw SerializationError("not a serialized index");
+				}
+				if(header.endianness != EndiannessMarker) {
+					throw SerializationError("serialized index was written on a machine with a different byte order");
+				}
+				if(header.version != SerializationVersion) {
+					throw SerializationError(std::format("unsupported serialized index version {} (expected {})", header.version, SerializationVersion));
+				}
+				if(header.typeInfo != expectedTypeInfo) {
+					throw SerializationError("serialized index was written with different dimensions or types");
+				}
+				if(header.payloadSize != bytes.size() - HeaderBlockSize) {
+					throw SerializationError("serialized index is truncated");
+				}
+				payload_ = bytes.subspan(HeaderBlockSize);
+				if(verifyChecksum) {
+					Checksum checksum;
+					checksum.update(payload_);
+					if(checksum.value() != header.checksum) {
+						throw SerializationError("serialized index is corrupted (checksum mismatch)");
+					}
+				}
+			}
+
+			template<typename T>
+				requires std::is_trivially_copyable_v<T>
+			[[nodiscard]] std::span<const T> readSection(uint32_t tag) {
+				if(payload_.size() - offset_ < SectionHeaderBlockSize) {
+					throw SerializationError("serialized index ends unexpectedly");
+				}
+				SectionHeader header;
+				std::memcpy(&header, payload_.data() + offset_, sizeof(header));
+				offset_ += SectionHeaderBlockSize;
+				if(header.tag != tag || header.elementSize != sizeof(T)) {
+					throw SerializationError("serialized index has an unexpected layout");
+				}
+				if(header.count > (payload_.size() - offset_) / sizeof(T)) {
+					throw SerializationError("serialized index ends unexpectedly");
+				}
+				size_t size = header.count * sizeof(T);
+				auto data = reinterpret_cast<const T*>(payload_.data() + offset_);
+				offset_ = std::min(payload_.size(), offset_ + alignUp(size, SectionAlignment));
+				return {data, header.count};
+			}
+
+			template<typename T>
+			[[nodiscard]] T readValue(uint32_t tag) {
+				auto section = readSection<T>(tag);
+				if(section.size() != 1) {
+					throw SerializationError("serialized index has an unexpected layout");
+				}
+				return section[0];
+			}
+
+			[[nodiscard]] const std::shared_ptr<const MappedFile>& file() const {
+				return file_;
+			}
+
+		private:
+			std::shared_ptr<const MappedFile> file_;
+			std::span<const std::byte> payload_;
+			size_t offset_ = 0;
+		};
+
+	}
+
+}
+
+#endif //SERIALIZATION_HPP
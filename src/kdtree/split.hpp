@@ -0,0 +1,353 @@
+
+#ifndef SPLIT_HPP
+#define SPLIT_HPP
+
+#include <array>
+#include <algorithm>
+#include <concepts>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <span>
+#include <vector>
+
+#include "hyperbox.hpp"
+
+namespace iui {
+
+	/*
+	 * how a KDTree picks the split of an inner node: `findSplit` gets the node's entries, its cell
+	 * and a generator seeded for this node, and returns a split along an axis on which the entries differ,
+	 * with a value between their smallest and largest coordinate (the tree halves the entries at their median
+	 * on the axis if it is not), or nothing if it finds none.
+	 * a policy may reorder `entries`; the tree partitions them by the returned split afterwards,
+	 * putting entries below the value left, entries above it right and dividing entries on it between
+	 * the two sides so that they come out as even as possible
+	 */
+	template<typename T, typename TEntry, typename THyperbox>
+	concept BalancingPolicy = requires(std::span<TEntry> entries, const THyperbox& cell, std::mt19937_64& gen)
+	{
+		{T::findSplit(entries, cell, gen)} -> std::same_as<std::optional<typename THyperbox::Split>>;
+	};
+
+	/*
+	 * how ExactMedianSplit and SampledMedianSplit pick their axis
+	 */
+	enum class SplitAxisRule {
+		WidestSpread,
+		HighestVariance
+	};
+
+	namespace detail {
+
+		template<typename TEntry>
+		using EntryCoordType = std::remove_cvref_t<decltype(std::declval<TEntry>().coord[0])>;
+
+		template<typename TEntry>
+		inline constexpr int EntryDims = decltype(std::declval<TEntry>().coord)::NumDimensions;
+
+		/*
+		 * the per-axis bounding box of `entries`
+		 */
+		template<typename TEntry>
+		struct EntryExtent {
+			std::array<EntryCoordType<TEntry>, EntryDims<TEntry>> lower, upper;
+
+			explicit EntryExtent(std::span<const TEntry> entries) {
+				lower.fill(std::numeric_limits<EntryCoordType<TEntry>>::max());
+				upper.fill(std::numeric_limits<EntryCoordType<TEntry>>::lowest());
+				for(const auto& entry: entries) {
+					for(int axis=0; axis<EntryDims<TEntry>; axis++) {
+						lower[axis] = std::min(lower[axis], entry.coord[axis]);
+						upper[axis] = std::max(upper[axis], entry.coord[axis]);
+					}
+				}
+			}
+
+			[[nodiscard]] double spread(int axis) const {
+				return double(upper[axis]) - double(lower[axis]);
+			}
+		};
+
+		/*
+		 * the axis with the widest spread or the highest variance among `entries`, or nothing if all entries are equal
+		 */
+		template<typename TEntry>
+		[[nodiscard]] std::optional<int> pickSplitAxis(std::span<const TEntry> entries, SplitAxisRule rule) {
+			static constexpr int NDims = EntryDims<TEntry>;
+			std::array<double, NDims> score {};
+			if(rule == SplitAxisRule::WidestSpread) {
+				EntryExtent<TEntry> extent(entries);
+				for(int axis=0; axis<NDims; axis++) {
+					score[axis] = extent.spread(axis);
+				}
+			} else {
+				std::array<double, NDims> mean {};
+				for(const auto& entry: entries) {
+					for(int axis=0; axis<NDims; axis++) {
+						mean[axis] += entry.coord[axis];
+					}
+				}
+				for(int axis=0; axis<NDims; axis++) {
+					mean[axis] /= entries.size();
+				}
+				for(const auto& entry: entries) {
+					for(int axis=0; axis<NDims; axis++) {
+						double diff = entry.coord[axis] - mean[axis];
+						score[axis] += diff * diff;
+					}
+				}
+			}
+			int axis = std::max_element(score.begin(), score.end()) - score.begin();
+			if(score[axis] <= 0.0) {
+				return std::nullopt;
+			}
+			return axis;
+		}
+
+		/*
+		 * the smallest coordinate along `axis` that is greater than `value`, if there is one
+		 */
+		template<typename TEntry>
+		[[nodiscard]] std::optional<EntryCoordType<TEntry>> nextCoordAbove(std::span<const TEntry> entries, int axis, EntryCoordType<TEntry> value) {
+			std::optional<EntryCoordType<TEntry>> result;
+			for(const auto& entry: entries) {
+				if(entry.coord[axis] > value && (not result || entry.coord[axis] < *result)) {
+					result = entry.coord[axis];
+				}
+			}
+			return result;
+		}
+
+		template<typename TSplit>
+		struct HyperboxSplitRecord {
+			double score {};
+			TSplit split {};
+		};
+
+		/*
+		 * splits at the median along `axis` and scores how evenly that divides `entries`
+		 */
+		template<typename TSplit, typename TEntry>
+		[[nodiscard]] HyperboxSplitRecord<TSplit> trySplit(std::span<TEntry> entries, int axis) {
+			int mid = entries.size() / 2;
+			std::nth_element(entries.begin(), entries.begin()+mid, entries.end(), [axis](const TEntry& a, const TEntry& b) {
+				return a.coord[axis] < b.coord[axis];
+			});
+			auto median = entries[mid].coord[axis];
+			auto leftSize = std::ranges::count_if(entries, [axis, median](const TEntry& entry) {
+				return entry.coord[axis] < median;
+			});
+			auto rightSize = std::ssize(entries) - leftSize;
+
+			int sizeDiff = std::abs(leftSize - rightSize);
+			int maxAbsInvScore = std::ssize(entries) - (std::ssize(entries) % 2);
+			int absInvScore = std::ssize(entries) - sizeDiff;
+
+			double score = double(absInvScore) / double(maxAbsInvScore);
+
+			return HyperboxSplitRecord<TSplit> {
+				.score = score,
+				.split = {
+					.axis = axis,
+					.value = median
+				}
+			};
+		}
+
+	}
+
+	/*
+	 * splits at the median of a random axis, retrying other random axes while the entries below and above
+	 * the median differ in number by more than 10% (because many of them share it, e.g. on mostly-zero axes);
+	 * cheap per axis, but blind to the shape of the data. if every try has all entries at or above the median,
+	 * splits the axis with the widest spread instead.
+	 * KDTree falls back to this policy whenever another one finds no split
+	 */
+	struct ApproximateMedianSplit {
+		template<typename TEntry, typename THyperbox>
+		[[nodiscard]] static std::optional<typename THyperbox::Split> findSplit(std::span<TEntry> entries, const THyperbox&, std::mt19937_64& gen) {
+			using SplitType = typename THyperbox::Split;
+			static constexpr int NDims = THyperbox::NumDimensions;
+			static constexpr double ViableScoreThreshold = 0.9;
+
+			std::vector<detail::HyperboxSplitRecord<SplitType>> splits;
+			for(int i=0; i<std::min<int>(NDims, 2.0 + 2.0 * std::log2(NDims)); i++) {
+				int axis = std::uniform_int_distribution<int>(0, NDims-1)(gen);
+				auto rec = detail::trySplit<SplitType>(entries, axis);
+				if(rec.score > ViableScoreThreshold) {
+					return rec.split;
+				}
+				splits.push_back(rec);
+			}
+
+			auto best = std::max_element(splits.begin(), splits.end(), [](auto&& a, auto&& b) {
+				return a.score < b.score;
+			});
+			if(best != splits.end() && best->score > 0.0) {
+				return best->split;
+			}
+			auto axis = detail::pickSplitAxis<TEntry>(entries, SplitAxisRule::WidestSpread);
+			if(not axis) {
+				return std::nullopt;
+			}
+			return detail::trySplit<SplitType>(entries, *axis).split;
+		}
+	};
+
+	/*
+	 * splits at the exact median of the axis with the widest spread or the highest variance
+	 */
+	template<SplitAxisRule Rule = SplitAxisRule::WidestSpread>
+	struct ExactMedianSplit {
+		template<typename TEntry, typename THyperbox>
+		[[nodiscard]] static std::optional<typename THyperbox::Split> findSplit(std::span<TEntry> entries, const THyperbox&, std::mt19937_64&) {
+			auto axis = detail::pickSplitAxis<TEntry>(entries, Rule);
+			if(not axis) {
+				return std::nullopt;
+			}
+			size_t mid = entries.size() / 2;
+			std::nth_element(entries.begin(), entries.begin()+mid, entries.end(), [axis = *axis](const TEntry& a, const TEntry& b) {
+				return a.coord[axis] < b.coord[axis];
+			});
+			return typename THyperbox::Split {.axis = *axis, .value = entries[mid].coord[*axis]};
+		}
+	};
+
+	/*
+	 * the sliding midpoint rule: halves the node's cell along its longest side (among the axes on which
+	 * the entries differ), and if all entries fall on one side, slides the plane to the nearest entry so that
+	 * it ends up on the other side alone. cells stay fat even for clustered data, at the cost of unbalanced trees
+	 */
+	struct SlidingMidpointSplit {
+		template<typename TEntry, typename THyperbox>
+		[[nodiscard]] static std::optional<typename THyperbox::Split> findSplit(std::span<TEntry> entries, const THyperbox& cell, std::mt19937_64&) {
+			using TCoord = typename THyperbox::CoordType;
+			static constexpr int NDims = THyperbox::NumDimensions;
+
+			detail::EntryExtent<TEntry> extent(entries);
+			int axis = -1;
+			double longestSide = -1.0;
+			for(int i=0; i<NDims; i++) {
+				double side = double(cell.pos1[i]) - double(cell.pos0[i]);
+				if(extent.spread(i) > 0.0 && side > longestSide) {
+					axis = i;
+					longestSide = side;
+				}
+			}
+			if(axis < 0) {
+				return std::nullopt;
+			}
+
+			double midpoint = 0.5 * (double(cell.pos0[axis]) + double(cell.pos1[axis]));
+			TCoord value;
+			if constexpr(std::is_integral_v<TCoord>) {
+				value = TCoord(std::ceil(midpoint));
+			} else {
+				value = TCoord(midpoint);
+			}
+
+			if(value <= extent.lower[axis]) {
+				value = *detail::nextCoordAbove<TEntry>(entries, axis, extent.lower[axis]);
+			} else if(value > extent.upper[axis]) {
+				value = extent.upper[axis];
+			}
+			return typename THyperbox::Split {.axis = axis, .value = value};
+		}
+	};
+
+	/*
+	 * like ExactMedianSplit, but picks the axis and the median from a random subsample of `SampleSize` entries,
+	 * which saves the full nth_element at the cost of less even splits
+	 */
+	template<size_t SampleSize = 128, SplitAxisRule Rule = SplitAxisRule::HighestVariance>
+	struct SampledMedianSplit {
+		template<typename TEntry, typename THyperbox>
+		[[nodiscard]] static std::optional<typename THyperbox::Split> findSplit(std::span<TEntry> entries, const THyperbox& cell, std::mt19937_64& gen) {
+			if(entries.size() <= 2 * SampleSize) {
+				return ExactMedianSplit<Rule>::findSplit(entries, cell, gen);
+			}
+
+			std::vector<TEntry> sample;
+			sample.reserve(SampleSize);
+			std::uniform_int_distribution<size_t> pick(0, entries.size() - 1);
+			for(size_t i=0; i<SampleSize; i++) {
+				sample.push_back(entries[pick(gen)]);
+			}
+
+			return ExactMedianSplit<Rule>::findSplit(std::span(sample), cell, gen);
+		}
+	};
+
+	/*
+	 * a cost-model split in the spirit of the surface area heuristic: a small query ball visits a node roughly
+	 * in proportion to the margin (sum of side lengths) of the node's bounding box, and then scans its entries,
+	 * so a split costs margin(left) * |left| + margin(right) * |right|. candidates are `NumBins` - 1 evenly
+	 * spaced planes on each of the `NumCandidateAxes` axes with the widest spread
+	 */
+	template<int NumBins = 32, int NumCandidateAxes = 8>
+	struct CostModelSplit {
+		template<typename TEntry, typename THyperbox>
+		[[nodiscard]] static std::optional<typename THyperbox::Split> findSplit(std::span<TEntry> entries, const THyperbox&, std::mt19937_64&) {
+			using TCoord = typename THyperbox::CoordType;
+			static constexpr int NDims = THyperbox::NumDimensions;
+			static constexpr int NumAxes = std::min(NDims, NumCandidateAxes);
+
+			detail::EntryExtent<TEntry> extent(entries);
+			double margin = 0.0;
+			std::array<int, NDims> axes;
+			for(int axis=0; axis<NDims; axis++) {
+				margin += extent.spread(axis);
+				axes[axis] = axis;
+			}
+			std::partial_sort(axes.begin(), axes.begin() + NumAxes, axes.end(), [&](int a, int b) {
+				return extent.spread(a) > extent.spread(b);
+			});
+
+			double bestCost = std::numeric_limits<double>::infinity();
+			std::optional<typename THyperbox::Split> best;
+			for(int axis: std::span(axes).first(NumAxes)) {
+				double lower = extent.lower[axis];
+				double spread = extent.spread(axis);
+				if(spread <= 0.0) {
+					break;
+				}
+
+				std::array<size_t, NumBins> binSizes {};
+				for(const auto& entry: entries) {
+					int bin = int((double(entry.coord[axis]) - lower) / spread * NumBins);
+					binSizes[std::clamp(bin, 0, NumBins - 1)]++;
+				}
+
+				/* only the side along `axis` differs between the children's margins */
+				double otherSides = margin - spread;
+				size_t leftSize = 0;
+				for(int bin=1; bin<NumBins; bin++) {
+					leftSize += binSizes[bin - 1];
+					size_t rightSize = entries.size() - leftSize;
+					if(leftSize == 0 || rightSize == 0) {
+						continue;
+					}
+					double leftSide = spread * bin / NumBins;
+					double cost = (otherSides + leftSide) * leftSize + (otherSides + spread - leftSide) * rightSize;
+					if(cost < bestCost) {
+						TCoord value;
+						if constexpr(std::is_integral_v<TCoord>) {
+							value = TCoord(std::ceil(lower + leftSide));
+						} else {
+							value = TCoord(lower + leftSide);
+						}
+						bestCost = cost;
+						best = typename THyperbox::Split {.axis = axis, .value = value};
+					}
+				}
+			}
+			return best;
+		}
+	};
+
+}
+
+#endif //SPLIT_HPP
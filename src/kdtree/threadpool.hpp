@@ -0,0 +1,240 @@
+
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+namespace iui {
+
+	class ThreadPool;
+
+	/*
+	 * a set of tasks submitted to a ThreadPool that can be waited on together.
+	 * the waiting thread runs queued tasks itself instead of blocking,
+	 * so groups may be nested (tasks may fork and wait for their own groups)
+	 */
+	class TaskGroup {
+	public:
+		TaskGroup() = default;
+		TaskGroup(const TaskGroup&) = delete;
+		TaskGroup& operator=(const TaskGroup&) = delete;
+
+		void wait(ThreadPool& pool);
+
+	private:
+		friend class ThreadPool;
+
+		void finish(std::exception_ptr exception) {
+			if(exception) {
+				std::lock_guard lock(exceptionMutex_);
+				if(not exception_) {
+					exception_ = exception;
+				}
+			}
+			pending_.fetch_sub(1, std::memory_order_acq_rel);
+		}
+
+		std::atomic<int64_t> pending_ {0};
+		std::mutex exceptionMutex_;
+		std::exception_ptr exception_;
+	};
+
+	/*
+	 * a fork-join pool with one task deque per worker. workers pop their own tasks LIFO
+	 * and steal from the front of other workers' deques when they run out.
+	 * `numThreads` counts the thread that calls TaskGroup::wait, so a pool of 1 has no workers
+	 * and runs everything on the caller.
+	 */
+	class ThreadPool {
+	public:
+		explicit ThreadPool(int numThreads = std::max<int>(1, std::thread::hardware_concurrency()))
+			: numThreads_(std::max(1, numThreads))
+		{
+			for(int i=0; i<numThreads_; i++) {
+				queues_.push_back(std::make_unique<Queue>());
+			}
+			for(int i=1; i<numThreads_; i++) {
+				workers_.emplace_back([this, i]() {
+					workerLoop(i);
+				});
+			}
+		}
+
+		~ThreadPool() {
+			{
+				std::lock_guard lock(sleepMutex_);
+				stopping_ = true;
+			}
+			sleepCv_.notify_all();
+			for(auto& worker: workers_) {
+				worker.join();
+			}
+		}
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		[[nodiscard]] int numThreads() const {
+			return numThreads_;
+		}
+
+		template<std::invocable FnT>
+		void submit(TaskGroup& group, FnT&& fn) {
+			group.pending_.fetch_add(1, std::memory_order_relaxed);
+			Task task = [&group, fn = std::forward<FnT>(fn)]() mutable {
+				std::exception_ptr exception;
+				try {
+					fn();
+				} catch(...) {
+					exception = std::current_exception();
+				}
+				group.finish(exception);
+			};
+
+			int queueIndex = currentQueueIndex();
+			if(queueIndex < 0) {
+				queueIndex = nextQueue_.fetch_add(1, std::memory_order_relaxed) % numThreads_;
+			}
+			{
+				std::lock_guard lock(queues_[queueIndex]->mutex);
+				queues_[queueIndex]->tasks.push_back(std::move(task));
+			}
+			{
+				std::lock_guard lock(sleepMutex_);
+				queued_++;
+			}
+			sleepCv_.notify_one();
+		}
+
+		/*
+		 * calls fn(begin, end) on consecutive chunks of [0, count) in parallel and waits for all of them
+		 */
+		template<std::invocable<size_t, size_t> FnT>
+		void parallelFor(size_t count, size_t chunkSize, FnT&& fn) {
+			chunkSize = std::max<size_t>(1, chunkSize);
+			TaskGroup group;
+			for(size_t begin = 0; begin < count; begin += chunkSize) {
+				size_t end = std::min(count, begin + chunkSize);
+				submit(group, [&fn, begin, end]() {
+					fn(begin, end);
+				});
+			}
+			group.wait(*this);
+		}
+
+		/*
+		 * runs one queued task on the calling thread, if there is any
+		 */
+		bool tryRunOne() {
+			int self = currentQueueIndex();
+			Task task;
+			if(not tryPop(self < 0 ? 0 : self, task)) {
+				return false;
+			}
+			task();
+			return true;
+		}
+
+	private:
+		using Task = std::function<void()>;
+
+		struct Queue {
+			std::mutex mutex;
+			std::deque<Task> tasks;
+		};
+
+		struct CurrentWorker {
+			const ThreadPool* pool = nullptr;
+			int index = -1;
+		};
+
+		static CurrentWorker& currentWorker() {
+			thread_local CurrentWorker worker;
+			return worker;
+		}
+
+		[[nodiscard]] int currentQueueIndex() const {
+			const auto& worker = currentWorker();
+			return worker.pool == this ? worker.index : -1;
+		}
+
+		bool tryPop(int self, Task& task) {
+			{
+				std::lock_guard lock(queues_[self]->mutex);
+				if(not queues_[self]->tasks.empty()) {
+					task = std::move(queues_[self]->tasks.back());
+					queues_[self]->tasks.pop_back();
+					onDequeued();
+					return true;
+				}
+			}
+			for(int i=1; i<numThreads_; i++) {
+				auto& victim = *queues_[(self + i) % numThreads_];
+				std::lock_guard lock(victim.mutex);
+				if(not victim.tasks.empty()) {
+					task = std::move(victim.tasks.front());
+					victim.tasks.pop_front();
+					onDequeued();
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void onDequeued() {
+			std::lock_guard lock(sleepMutex_);
+			queued_--;
+		}
+
+		void workerLoop(int index) {
+			currentWorker() = {this, index};
+			while(true) {
+				Task task;
+				if(tryPop(index, task)) {
+					task();
+					continue;
+				}
+				std::unique_lock lock(sleepMutex_);
+				sleepCv_.wait(lock, [this]() {
+					return stopping_ || queued_ > 0;
+				});
+				if(stopping_ && queued_ == 0) {
+					return;
+				}
+			}
+		}
+
+		int numThreads_;
+		std::vector<std::unique_ptr<Queue>> queues_;
+		std::vector<std::thread> workers_;
+		std::atomic<int> nextQueue_ {0};
+
+		std::mutex sleepMutex_;
+		std::condition_variable sleepCv_;
+		int64_t queued_ = 0;
+		bool stopping_ = false;
+	};
+
+	inline void TaskGroup::wait(ThreadPool& pool) {
+		while(pending_.load(std::memory_order_acquire) > 0) {
+			if(not pool.tryRunOne()) {
+				std::this_thread::yield();
+			}
+		}
+		if(exception_) {
+			std::rethrow_exception(std::exchange(exception_, nullptr));
+		}
+	}
+
+}
+
+#endif //THREADPOOL_HPP
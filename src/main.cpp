@@ -1,43 +1,151 @@
 #include <iostream>
 #include <random>
 #include <chrono>
+#include <thread>
+#include <memory>
 
 #include "mnistReader.hpp"
 #include "dryBeansReader.hpp"
 #include "kdtree/knn.hpp"
 #include "kdtree/pca.hpp"
+#include "kdtree/randomprojection.hpp"
 
-template<typename TClassifier>
-void benchmarkClassifier(auto trainingData, auto valData, int k = 3, std::optional<double> initRadius = {}) {
-
-	auto t0 = std::chrono::high_resolution_clock::now();
-	TClassifier classifier(trainingData);
-	auto t1 = std::chrono::high_resolution_clock::now();
+std::vector<int> threadCounts() {
+	int maxThreads = std::max<int>(1, std::thread::hardware_concurrency());
+	std::vector<int> result;
+	for(int n=1; n<maxThreads; n*=2) {
+		result.push_back(n);
+	}
+	result.push_back(maxThreads);
+	return result;
+}
 
-	auto t2 = std::chrono::high_resolution_clock::now();
-	for(const auto& valSmp: valData) {
-		const auto& [pos, label] = valSmp;
-		auto prediction = classifier.predict(pos, k, initRadius, label);
+const char* strategyName(iui::KNNSearchStrategy strategy) {
+	switch(strategy) {
+		case iui::KNNSearchStrategy::RadiusDoubling:
+			return "radius-doubling";
+		case iui::KNNSearchStrategy::BestFirst:
+			return "best-first";
+		case iui::KNNSearchStrategy::IncrementalBestFirst:
+			return "incremental";
 	}
-	auto t3 = std::chrono::high_resolution_clock::now();
+	return "?";
+}
+
+/*
+ * if the classifier's reducer can be made from `reducerModel` (e.g. a PCAModel), it is, instead of being fitted
+ * by every classifier; the ctor time then only covers the tree
+ */
+template<typename TClassifier, typename TReducerModel = std::nullptr_t>
+void benchmarkClassifier(
+	auto trainingData,
+	auto valData,
+	int k = 3,
+	std::optional<double> initRadius = {},
+	iui::KDTreeBuildOptions treeOptions = {},
+	const TReducerModel& reducerModel = nullptr
+) {
 
 	using DurMillis = std::chrono::duration<double, std::milli>;
-	double millisCtor = std::chrono::duration_cast<DurMillis>(t1 - t0).count();
-	double millisTest = std::chrono::duration_cast<DurMillis>(t3 - t2).count();
 
+	std::unique_ptr<TClassifier> classifierPtr;
+	double millisCtor = 0.0;
+	for(int numThreads: threadCounts()) {
+		auto t0 = std::chrono::high_resolution_clock::now();
+		treeOptions.seed = 1;
+		treeOptions.numThreads = numThreads;
+		using TReducer = typename TClassifier::DimensionalityReducerType;
+		if constexpr(std::is_constructible_v<TReducer, const TReducerModel&>) {
+			classifierPtr = std::make_unique<TClassifier>(TReducer(reducerModel), trainingData, treeOptions);
+		} else {
+			classifierPtr = std::make_unique<TClassifier>(trainingData, treeOptions);
+		}
+		auto t1 = std::chrono::high_resolution_clock::now();
+
+		millisCtor = std::chrono::duration_cast<DurMillis>(t1 - t0).count();
+		std::cout << std::format("n={:3d}, ctor with {:2d} threads: {:.2f} ms\n", TClassifier::NumTreeDimensions, numThreads, millisCtor);
+	}
+	TClassifier& classifier = *classifierPtr;
+
+	auto memStats = classifier.tree().memoryStats();
 	std::cout << std::format(
-		"n={:3d}, k={:2d}, accuracy: {:.2f}% ({} / {}), efficiency: {:.2f}%, ctor {:.2f} ms, test {:.2f} ms\n",
+		"n={:3d}, tree: {} nodes, {} B/node ({} B/node pointer-based), {} kB of nodes, {} kB of entries, {} kB of SoA leaves, {} kB of node bounds\n",
 		TClassifier::NumTreeDimensions,
-		k,
-		100.0 * classifier.getStats().accuracy(),
-		classifier.getStats().accuratePredictions,
-		classifier.getStats().totalPredictions,
-		100.0 * classifier.getStats().efficiency(),
-		millisCtor,
-		millisTest);
+		memStats.numNodes,
+		memStats.bytesPerNode,
+		memStats.bytesPerNodePointerBased,
+		memStats.nodeBytes / 1024,
+		memStats.entryBytes / 1024,
+		memStats.soaBytes / 1024,
+		memStats.boundsBytes / 1024);
+
+	for(auto strategy: {iui::KNNSearchStrategy::RadiusDoubling, iui::KNNSearchStrategy::BestFirst, iui::KNNSearchStrategy::IncrementalBestFirst}) {
+		classifier.resetStats();
+		classifier.setSearchStrategy(strategy);
+
+		auto t2 = std::chrono::high_resolution_clock::now();
+		for(const auto& valSmp: valData) {
+			const auto& [pos, label] = valSmp;
+			auto prediction = classifier.predict(pos, k, initRadius, label);
+		}
+		auto t3 = std::chrono::high_resolution_clock::now();
+
+		double millisTest = std::chrono::duration_cast<DurMillis>(t3 - t2).count();
+
+		std::cout << std::format(
+			"n={:3d}, k={:2d}, {:>14}: accuracy: {:.2f}% ({} / {}), efficiency: {:.2f}%, coords touched: {:.1f}%, ctor {:.2f} ms, test {:.2f} ms\n",
+			TClassifier::NumTreeDimensions,
+			k,
+			strategyName(strategy),
+			100.0 * classifier.getStats().accuracy(),
+			classifier.getStats().accuratePredictions,
+			classifier.getStats().totalPredictions,
+			100.0 * classifier.getStats().efficiency(),
+			100.0 * classifier.getStats().coordinatesTouchedRatio(TClassifier::NumTreeDimensions),
+			millisCtor,
+			millisTest);
+	}
+
+	std::vector<typename TClassifier::PointType> valPoints;
+	std::vector<typename TClassifier::LabelType> valLabels;
+	for(const auto& valSmp: valData) {
+		const auto& [pos, label] = valSmp;
+		valPoints.push_back(pos);
+		valLabels.push_back(label);
+	}
+	std::vector<typename TClassifier::LabelType> predictions(valPoints.size());
+
+	for(int numThreads: threadCounts()) {
+		iui::ThreadPool pool(numThreads);
+		classifier.resetStats();
+
+		auto t4 = std::chrono::high_resolution_clock::now();
+		classifier.predictBatch(valPoints, predictions, k, pool, valLabels);
+		auto t5 = std::chrono::high_resolution_clock::now();
+
+		double millisBatch = std::chrono::duration_cast<DurMillis>(t5 - t4).count();
+		std::cout << std::format(
+			"n={:3d}, k={:2d}, batch with {:2d} threads: accuracy: {:.2f}%, test {:.2f} ms ({:.0f} queries/s)\n",
+			TClassifier::NumTreeDimensions,
+			k,
+			numThreads,
+			100.0 * classifier.getStats().accuracy(),
+			millisBatch,
+			1000.0 * valPoints.size() / millisBatch);
+	}
 }
 
-void testCurseOfDimensionality(auto&& mnistTrain, auto&& mnistVal) {
+/*
+ * the principal components of the MNIST training set, fitted once and shared by the dimension sweeps
+ */
+iui::PCAModel<int, 784> fitMNISTPCAModel(auto&& mnistTrain) {
+	return iui::PCAModel<int, 784>(std::views::transform(mnistTrain, [](const auto& entry) {
+		const auto& [position, label] = entry;
+		return position;
+	}));
+}
+
+void testCurseOfDimensionality(auto&& mnistTrain, auto&& mnistVal, const iui::PCAModel<int, 784>& pcaModel) {
 
 	printf("testing curse of dimensionality...\n");
 	[&]<std::size_t... Idxs>(std::index_sequence<Idxs...> _){
@@ -45,12 +153,12 @@ void testCurseOfDimensionality(auto&& mnistTrain, auto&& mnistVal) {
 			benchmarkClassifier<
 			iui::KNNClassifier<
 				iui::ManhattanDistanceMetric, int, int, 784, iui::PrincipalComponentAnalysis, nDims()
-			>>(mnistTrain, mnistVal, 3);
+			>>(mnistTrain, mnistVal, 3, {}, {}, pcaModel);
 		})(std::integral_constant<int, Idxs + 1>{}), ...);
 	}(std::make_index_sequence<50>{});
 }
 
-void benchmarkManhattan(auto&& mnistTrain, auto&& mnistVal) {
+void benchmarkManhattan(auto&& mnistTrain, auto&& mnistVal, const iui::PCAModel<int, 784>& pcaModel) {
 	printf("benchmarking MNIST dataset (Manhattan)...\n");
 	[&]<std::size_t... Idxs>(std::index_sequence<Idxs...> _){
 		(([&](auto nDims) {
@@ -58,14 +166,14 @@ void benchmarkManhattan(auto&& mnistTrain, auto&& mnistVal) {
 				benchmarkClassifier<
 				iui::KNNClassifier<
 					iui::ManhattanDistanceMetric, int, int, 784, iui::PrincipalComponentAnalysis, nDims()
-				>>(mnistTrain, mnistVal, k);
+				>>(mnistTrain, mnistVal, k, {}, {}, pcaModel);
 			}
 		})(std::integral_constant<int, Idxs>{}), ...);
 	}(std::index_sequence<3, 8, 16, 72, 784>{});
 }
 
 
-void benchmarkEuclidean(auto&& mnistTrain, auto&& mnistVal) {
+void benchmarkEuclidean(auto&& mnistTrain, auto&& mnistVal, const iui::PCAModel<int, 784>& pcaModel) {
 	printf("benchmarking MNIST dataset (Euclidean)...\n");
 	[&]<std::size_t... Idxs>(std::index_sequence<Idxs...> _){
 		(([&](auto nDims) {
@@ -73,12 +181,380 @@ void benchmarkEuclidean(auto&& mnistTrain, auto&& mnistVal) {
 				benchmarkClassifier<
 				iui::KNNClassifier<
 					iui::EuclideanDistanceMetric, int, int, 784, iui::PrincipalComponentAnalysis, nDims()
-				>>(mnistTrain, mnistVal, k);
+				>>(mnistTrain, mnistVal, k, {}, {}, pcaModel);
 			}
 		})(std::integral_constant<int, Idxs>{}), ...);
 	}(std::index_sequence<3, 8, 16, 72, 784>{});
 }
 
+/*
+ * times fitting PCA on the MNIST training set with both solvers; "captured" is the variance of the projected
+ * validation set relative to the covariance solver's
+ */
+void benchmarkPCAFit(auto&& mnistTrain, auto&& mnistVal) {
+	using DurMillis = std::chrono::duration<double, std::milli>;
+	using TPCA = iui::PrincipalComponentAnalysis<int, 784, 16>;
+
+	auto trainPoints = std::views::transform(mnistTrain, [](const auto& entry) {
+		const auto& [position, label] = entry;
+		return position;
+	});
+	auto projectedVariance = [&](const TPCA& pca) {
+		double total = 0.0;
+		for(const auto& [pos, label]: mnistVal) {
+			auto reduced = pca.reduce(pos);
+			reduced.forEach([&](int v) {
+				total += double(v) * v;
+			});
+		}
+		return total;
+	};
+
+	printf("benchmarking PCA fitting on the MNIST dataset (784 -> 16 dimensions)...\n");
+	double reference = 0.0;
+	for(auto solver: {iui::PCASolver::Covariance, iui::PCASolver::Randomized}) {
+		auto t0 = std::chrono::high_resolution_clock::now();
+		TPCA pca(trainPoints, {.solver = solver, .seed = 1});
+		auto t1 = std::chrono::high_resolution_clock::now();
+		double variance = projectedVariance(pca);
+		if(solver == iui::PCASolver::Covariance) {
+			reference = variance;
+		}
+		std::cout << std::format(
+			"{:>10} solver: fit {:.2f} ms, captured {:.4f}\n",
+			solver == iui::PCASolver::Covariance ? "covariance" : "randomized",
+			DurMillis(t1 - t0).count(),
+			iui::divOrZero(variance, reference)
+		);
+	}
+}
+
+/*
+ * compares random projections with PCA on MNIST: fitting the reducer, building the tree and batch accuracy
+ */
+void benchmarkRandomProjection(auto&& mnistTrain, auto&& mnistVal) {
+	using DurMillis = std::chrono::duration<double, std::milli>;
+
+	std::vector<iui::Vec<int, 784>> trainPoints, valPoints;
+	std::vector<int> valLabels;
+	for(const auto& [pos, label]: mnistTrain) {
+		trainPoints.push_back(pos);
+	}
+	for(const auto& [pos, label]: mnistVal) {
+		valPoints.push_back(pos);
+		valLabels.push_back(label);
+	}
+	std::vector<int> predictions(valPoints.size());
+	iui::ThreadPool pool(threadCounts().back());
+
+	printf("benchmarking random projections against PCA on the MNIST dataset (Euclidean, k=3)...\n");
+	[&]<std::size_t... Idxs>(std::index_sequence<Idxs...> _){
+		(([&](auto nDims) {
+			auto run = [&]<template<typename, int, int> typename TReducer>(const char* name, auto&& makeReducer) {
+				using TClassifier = iui::KNNClassifier<iui::EuclideanDistanceMetric, int, int, 784, TReducer, nDims()>;
+				auto t0 = std::chrono::high_resolution_clock::now();
+				TReducer<int, 784, nDims()> reducer = makeReducer();
+				auto t1 = std::chrono::high_resolution_clock::now();
+				TClassifier classifier(std::move(reducer), mnistTrain, {.seed = 1});
+				auto t2 = std::chrono::high_resolution_clock::now();
+				classifier.predictBatch(valPoints, predictions, 3, pool, valLabels);
+				auto t3 = std::chrono::high_resolution_clock::now();
+				std::cout << std::format(
+					"n={:3d}, {:>26}: fit {:8.2f} ms, ctor {:8.2f} ms, batch {:8.2f} ms, accuracy {:.2f}%\n",
+					nDims(),
+					name,
+					DurMillis(t1 - t0).count(),
+					DurMillis(t2 - t1).count(),
+					DurMillis(t3 - t2).count(),
+					100.0 * classifier.getStats().accuracy()
+				);
+			};
+			run.template operator()<iui::PrincipalComponentAnalysis>("PCA", [&]() {
+				return iui::PrincipalComponentAnalysis<int, 784, nDims()>(trainPoints);
+			});
+			run.template operator()<iui::PrincipalComponentAnalysis>("randomized PCA", [&]() {
+				return iui::PrincipalComponentAnalysis<int, 784, nDims()>(trainPoints, {.solver = iui::PCASolver::Randomized, .seed = 1});
+			});
+			run.template operator()<iui::RandomProjection>("Achlioptas projection", [&]() {
+				return iui::RandomProjection<int, 784, nDims()>({.seed = 1});
+			});
+			run.template operator()<iui::RandomProjection>("very sparse projection", [&]() {
+				return iui::RandomProjection<int, 784, nDims()>({.density = 1.0 / std::sqrt(784.0), .seed = 1});
+			});
+		})(std::integral_constant<int, Idxs>{}), ...);
+	}(std::index_sequence<8, 16, 32, 72>{});
+}
+
+/*
+ * runs the tree at a few dimensions and re-ranks k * m of its candidates by their distance in all 784
+ */
+void benchmarkReranking(auto&& mnistTrain, auto&& mnistVal, const iui::PCAModel<int, 784>& pcaModel) {
+	using DurMillis = std::chrono::duration<double, std::milli>;
+
+	std::vector<iui::Vec<int, 784>> valPoints;
+	std::vector<int> valLabels;
+	for(const auto& [pos, label]: mnistVal) {
+		valPoints.push_back(pos);
+		valLabels.push_back(label);
+	}
+	std::vector<int> predictions(valPoints.size());
+	std::vector<int> coalescedPredictions(valPoints.size());
+	iui::ThreadPool pool(threadCounts().back());
+
+	printf("benchmarking re-ranking on the MNIST dataset (Euclidean, k=3)...\n");
+	[&]<std::size_t... Idxs>(std::index_sequence<Idxs...> _){
+		(([&](auto nDims) {
+			using TClassifier = iui::KNNClassifier<iui::EuclideanDistanceMetric, int, int, 784, iui::PrincipalComponentAnalysis, nDims()>;
+			TClassifier classifier(pcaModel, mnistTrain, {.seed = 1}, {.candidateMultiplier = 1});
+			for(int multiplier: {0, 2, 4, 8, 16}) {
+				classifier.setReranking({.candidateMultiplier = multiplier});
+				classifier.resetStats();
+				auto t0 = std::chrono::high_resolution_clock::now();
+				classifier.predictBatch(valPoints, predictions, 3, pool, valLabels);
+				auto t1 = std::chrono::high_resolution_clock::now();
+				std::cout << std::format(
+					"n={:3d}, {:2d}x candidates: accuracy {:.2f}%, efficiency {:.2f}%, batch {:.2f} ms\n",
+					nDims(),
+					multiplier,
+					100.0 * classifier.getStats().accuracy(),
+					100.0 * classifier.getStats().efficiency(),
+					DurMillis(t1 - t0).count()
+				);
+				classifier.predictBatchCoalesced(valPoints, coalescedPredictions, 3, pool);
+				if(coalescedPredictions != predictions) {
+					std::cout << "coalesced batch disagrees with the plain batch\n";
+				}
+			}
+		})(std::integral_constant<int, Idxs>{}), ...);
+	}(std::index_sequence<4, 8, 12, 16>{});
+}
+
+/*
+ * sweeps the classifier's approximation settings, comparing every prediction to the exact one
+ */
+template<typename TClassifier>
+void benchmarkApproximation(TClassifier& classifier, auto&& valData, int k, std::initializer_list<std::optional<int64_t>> leafBudgets, std::initializer_list<double> epsilons) {
+
+	using DurMillis = std::chrono::duration<double, std::milli>;
+
+	classifier.setApproximation({});
+	std::vector<typename TClassifier::LabelType> exactPredictions;
+	for(const auto& valSmp: valData) {
+		const auto& [pos, label] = valSmp;
+		exactPredictions.push_back(classifier.predict(pos, k));
+	}
+
+	for(std::optional<int64_t> maxLeaves: leafBudgets) {
+		for(double epsilon: epsilons) {
+			classifier.setApproximation({.epsilon = epsilon, .maxLeavesVisited = maxLeaves});
+			classifier.resetStats();
+
+			int agreeing = 0;
+			size_t i = 0;
+			auto t0 = std::chrono::high_resolution_clock::now();
+			for(const auto& valSmp: valData) {
+				const auto& [pos, label] = valSmp;
+				agreeing += classifier.predict(pos, k, std::nullopt, label) == exactPredictions[i++];
+			}
+			auto t1 = std::chrono::high_resolution_clock::now();
+
+			const auto& stats = classifier.getStats();
+			std::cout << std::format(
+				"n={:3d}, k={}, eps={:.1f}, max leaves {:>4}: accuracy: {:.2f}%, agrees with exact: {:.2f}%, "
+				"{:.0f} points/query, {:.1f}% coords touched, {:.1f} leaves/query, {:.1f}% truncated, test {:.2f} ms\n",
+				TClassifier::NumTreeDimensions,
+				k,
+				epsilon,
+				maxLeaves ? std::to_string(*maxLeaves) : "-",
+				100.0 * stats.accuracy(),
+				100.0 * iui::divOrZero(agreeing, exactPredictions.size()),
+				iui::divOrZero(stats.pointsVisited(), stats.totalPredictions),
+				100.0 * stats.coordinatesTouchedRatio(TClassifier::NumTreeDimensions),
+				iui::divOrZero(stats.leavesVisited, stats.totalPredictions),
+				100.0 * iui::divOrZero(stats.searchesTruncated, stats.totalPredictions),
+				DurMillis(t1 - t0).count());
+		}
+	}
+	classifier.setApproximation({});
+}
+
+void benchmarkApproximateSearch(auto&& mnistTrain, auto&& mnistVal) {
+	printf("benchmarking approximate search on the MNIST dataset (Euclidean)...\n");
+	[&]<std::size_t... Idxs>(std::index_sequence<Idxs...> _){
+		(([&](auto nDims) {
+			iui::KNNClassifier<iui::EuclideanDistanceMetric, int, int, 784, iui::PrincipalComponentAnalysis, nDims()> classifier(mnistTrain, {.seed = 1});
+			benchmarkApproximation(classifier, mnistVal, 3, {std::nullopt, 32, 8}, {0.0, 0.5, 1.0, 2.0, 5.0});
+		})(std::integral_constant<int, Idxs>{}), ...);
+	}(std::index_sequence<16, 72, 784>{});
+}
+
+void benchmarkForest(auto&& mnistTrain, auto&& mnistVal) {
+	printf("benchmarking randomized k-d forest on the MNIST dataset (Euclidean, no PCA)...\n");
+	using TTreeClassifier = iui::KNNClassifier<iui::EuclideanDistanceMetric, int, int, 784>;
+	using TForestClassifier = iui::KNNClassifier<iui::EuclideanDistanceMetric, int, int, 784, iui::NoDimensionalityReduction, 784, iui::KDForest>;
+
+	TTreeClassifier treeClassifier(mnistTrain, {.seed = 1});
+	printf("single tree:\n");
+	benchmarkApproximation(treeClassifier, mnistVal, 3, {std::nullopt, 256, 64, 16}, {0.0});
+
+	for(int numTrees: {1, 4, 8}) {
+		TForestClassifier forestClassifier(mnistTrain, {.seed = 1, .numForestTrees = numTrees});
+		printf("forest of %d trees:\n", numTrees);
+		benchmarkApproximation(forestClassifier, mnistVal, 3, {256, 64, 16}, {0.0});
+	}
+}
+
+const char* nodeBoundsName(iui::NodeBounds bounds) {
+	switch(bounds) {
+		case iui::NodeBounds::Cells:
+			return "cells";
+		case iui::NodeBounds::Tight:
+			return "tight";
+		case iui::NodeBounds::QuantizedTight:
+			return "quantized tight";
+	}
+	return "unknown";
+}
+
+/*
+ * compares pruning with the split planes' cells against pruning with the nodes' bounding boxes
+ */
+void benchmarkNodeBounds(auto&& mnistTrain, auto&& mnistVal) {
+	using DurMillis = std::chrono::duration<double, std::milli>;
+
+	printf("benchmarking node bounds on the MNIST dataset (Euclidean, k=3)...\n");
+	[&]<std::size_t... Idxs>(std::index_sequence<Idxs...> _){
+		(([&](auto nDims) {
+			using TClassifier = iui::KNNClassifier<iui::EuclideanDistanceMetric, int, int, 784, iui::PrincipalComponentAnalysis, nDims()>;
+			for(auto bounds: {iui::NodeBounds::Cells, iui::NodeBounds::Tight, iui::NodeBounds::QuantizedTight}) {
+				TClassifier classifier(mnistTrain, {.seed = 1, .nodeBounds = bounds});
+				for(auto strategy: {iui::KNNSearchStrategy::BestFirst, iui::KNNSearchStrategy::IncrementalBestFirst}) {
+					classifier.resetStats();
+					classifier.setSearchStrategy(strategy);
+
+					auto t0 = std::chrono::high_resolution_clock::now();
+					for(const auto& [pos, label]: mnistVal) {
+						(void)classifier.predict(pos, 3, std::nullopt, label);
+					}
+					auto t1 = std::chrono::high_resolution_clock::now();
+
+					const auto& stats = classifier.getStats();
+					std::cout << std::format(
+						"n={:3d}, {:>15} bounds ({:5} kB), {:>14}: efficiency: {:.2f}%, leaves/query: {:.1f}, test {:.2f} ms\n",
+						nDims(),
+						nodeBoundsName(bounds),
+						classifier.tree().memoryStats().boundsBytes / 1024,
+						strategyName(strategy),
+						100.0 * stats.efficiency(),
+						iui::divOrZero(stats.leavesVisited, stats.totalPredictions),
+						DurMillis(t1 - t0).count()
+					);
+				}
+			}
+		})(std::integral_constant<int, Idxs>{}), ...);
+	}(std::index_sequence<3, 8, 16>{});
+}
+
+/*
+ * compares the split policies' build times against how well the resulting trees prune.
+ * the build time is for the tree alone, on the already reduced entries
+ */
+void benchmarkSplitPolicies(auto&& mnistTrain, auto&& mnistVal) {
+	using DurMillis = std::chrono::duration<double, std::milli>;
+
+	printf("benchmarking split policies on the MNIST dataset (Euclidean, k=3)...\n");
+	[&]<std::size_t... Idxs>(std::index_sequence<Idxs...> _){
+		(([&](auto nDims) {
+			auto benchmarkPolicy = [&]<typename TSplitPolicy>(const char* name) {
+				using TClassifier = iui::KNNClassifier<
+					iui::EuclideanDistanceMetric, int, int, 784, iui::PrincipalComponentAnalysis, nDims(),
+					iui::KDTreeWith<TSplitPolicy>::template Tree
+				>;
+				TClassifier classifier(mnistTrain, {.seed = 1});
+
+				auto t0 = std::chrono::high_resolution_clock::now();
+				typename TClassifier::TreeType tree(classifier.tree().entries(), iui::KDTreeBuildOptions {.seed = 1});
+				auto t1 = std::chrono::high_resolution_clock::now();
+
+				for(const auto& [pos, label]: mnistVal) {
+					(void)classifier.predict(pos, 3, std::nullopt, label);
+				}
+				auto t2 = std::chrono::high_resolution_clock::now();
+
+				const auto& stats = classifier.getStats();
+				std::cout << std::format(
+					"n={:3d}, {:>20}: build {:.2f} ms ({} nodes), efficiency: {:.2f}%, leaves/query: {:.1f}, test {:.2f} ms\n",
+					nDims(),
+					name,
+					DurMillis(t1 - t0).count(),
+					tree.nodes().size(),
+					100.0 * stats.efficiency(),
+					iui::divOrZero(stats.leavesVisited, stats.totalPredictions),
+					DurMillis(t2 - t1).count()
+				);
+			};
+			benchmarkPolicy.template operator()<iui::ApproximateMedianSplit>("approximate median");
+			benchmarkPolicy.template operator()<iui::ExactMedianSplit<iui::SplitAxisRule::WidestSpread>>("median, widest");
+			benchmarkPolicy.template operator()<iui::ExactMedianSplit<iui::SplitAxisRule::HighestVariance>>("median, variance");
+			benchmarkPolicy.template operator()<iui::SampledMedianSplit<>>("sampled median");
+			benchmarkPolicy.template operator()<iui::SlidingMidpointSplit>("sliding midpoint");
+			benchmarkPolicy.template operator()<iui::CostModelSplit<>>("cost model");
+		})(std::integral_constant<int, Idxs>{}), ...);
+	}(std::index_sequence<8, 16>{});
+}
+
+const char* curveName(iui::SpaceFillingCurve curve) {
+	switch(curve) {
+		case iui::SpaceFillingCurve::None:
+			return "none";
+		case iui::SpaceFillingCurve::Morton:
+			return "Morton";
+		case iui::SpaceFillingCurve::Hilbert:
+			return "Hilbert";
+	}
+	return "unknown";
+}
+
+/*
+ * compares building with and answering batches in space-filling curve order against the order the build leaves entries in
+ */
+void benchmarkEntryOrder(auto&& mnistTrain, auto&& mnistVal) {
+	using DurMillis = std::chrono::duration<double, std::milli>;
+
+	std::vector<iui::Vec<int, 784>> valPoints;
+	for(const auto& [pos, label]: mnistVal) {
+		valPoints.push_back(pos);
+	}
+	std::vector<int> predictions(valPoints.size());
+	iui::ThreadPool pool(threadCounts().back());
+
+	printf("benchmarking entry order on the MNIST dataset (Euclidean, k=3)...\n");
+	[&]<std::size_t... Idxs>(std::index_sequence<Idxs...> _){
+		(([&](auto nDims) {
+			using TClassifier = iui::KNNClassifier<iui::EuclideanDistanceMetric, int, int, 784, iui::PrincipalComponentAnalysis, nDims()>;
+			for(auto curve: {iui::SpaceFillingCurve::None, iui::SpaceFillingCurve::Morton, iui::SpaceFillingCurve::Hilbert}) {
+				for(auto layout: {iui::LeafLayout::ArrayOfStructs, iui::LeafLayout::StructureOfArrays}) {
+					auto t0 = std::chrono::high_resolution_clock::now();
+					TClassifier classifier(mnistTrain, {.seed = 1, .leafLayout = layout, .entryOrder = curve});
+					auto t1 = std::chrono::high_resolution_clock::now();
+					classifier.predictBatch(valPoints, predictions, 3, pool);
+					auto t2 = std::chrono::high_resolution_clock::now();
+
+					std::cout << std::format(
+						"n={:3d}, {:>7} order, {} leaves: ctor {:.2f} ms, batch with {} threads {:.2f} ms\n",
+						nDims(),
+						curveName(curve),
+						layout == iui::LeafLayout::StructureOfArrays ? "SoA" : "AoS",
+						DurMillis(t1 - t0).count(),
+						pool.numThreads(),
+						DurMillis(t2 - t1).count()
+					);
+				}
+			}
+		})(std::integral_constant<int, Idxs>{}), ...);
+	}(std::index_sequence<8, 16>{});
+}
+
 void benchmarkPaletteQuantization() {
 
 	struct PaletteColor {
@@ -106,11 +582,329 @@ void benchmarkPaletteQuantization() {
 	}
 
 	using TClassifier = iui::KNNClassifier<iui::EuclideanDistanceMetric, int, float, 3>;
+	printf("array-of-structs leaves:\n");
 	benchmarkClassifier<TClassifier>(trainingSet, validationSet, 1);
+	printf("structure-of-arrays leaves:\n");
+	benchmarkClassifier<TClassifier>(trainingSet, validationSet, 1, {}, {.leafLayout = iui::LeafLayout::StructureOfArrays});
+}
+
+/*
+ * maps the pixels of a synthetic 8-bit image (smooth gradients with noise, so neighbouring and repeated
+ * colours are common) to a palette, with and without coalescing the queries
+ */
+void benchmarkCoalescedBatch() {
+	using DurMillis = std::chrono::duration<double, std::milli>;
+
+	struct PaletteColor {
+		iui::Vec3f position;
+		int value;
+	};
+	std::minstd_rand0 random {42};
+	std::uniform_real_distribution<float> colorDist(0.0f, 1.0f);
+	std::normal_distribution<float> noiseDist(0.0f, 2.0f);
+
+	std::vector<PaletteColor> palette;
+	for(int i=0; i<4096; i++) {
+		palette.push_back(PaletteColor {
+			.position = iui::Vec3f(colorDist(random), colorDist(random), colorDist(random)),
+			.value = i
+		});
+	}
+
+	auto quantize = [](float value) {
+		return std::clamp(std::round(value), 0.0f, 255.0f) / 255.0f;
+	};
+	constexpr int ImageSize = 1024;
+	std::vector<iui::Vec3f> pixels;
+	for(int y=0; y<ImageSize; y++) {
+		for(int x=0; x<ImageSize; x++) {
+			pixels.push_back(iui::Vec3f(
+				quantize(x * 255.0f / ImageSize + noiseDist(random)),
+				quantize(y * 255.0f / ImageSize + noiseDist(random)),
+				quantize((x + y) * 127.0f / ImageSize)
+			));
+		}
+	}
+	std::vector<int> predictions(pixels.size());
+	iui::ThreadPool pool(threadCounts().back());
+
+	printf("benchmarking coalesced batches on a %dx%d image with a %zu-color palette...\n", ImageSize, ImageSize, palette.size());
+	using TClassifier = iui::KNNClassifier<iui::EuclideanDistanceMetric, int, float, 3>;
+	for(auto strategy: {iui::KNNSearchStrategy::RadiusDoubling, iui::KNNSearchStrategy::IncrementalBestFirst}) {
+		TClassifier classifier(palette, {.seed = 1});
+		classifier.setSearchStrategy(strategy);
+		for(bool coalesced: {false, true}) {
+			classifier.resetStats();
+			auto t0 = std::chrono::high_resolution_clock::now();
+			if(coalesced) {
+				classifier.predictBatchCoalesced(pixels, predictions, 1, pool);
+			} else {
+				classifier.predictBatch(pixels, predictions, 1, pool);
+			}
+			auto t1 = std::chrono::high_resolution_clock::now();
+			const auto& stats = classifier.getStats();
+			std::cout << std::format(
+				"{:>14}, {:>9}: {:.2f} ms with {} threads, efficiency {:.4f}, {} leaves, {} queries coalesced\n",
+				strategy == iui::KNNSearchStrategy::RadiusDoubling ? "radius doubling" : "best-first",
+				coalesced ? "coalesced" : "plain",
+				DurMillis(t1 - t0).count(),
+				pool.numThreads(),
+				stats.efficiency(),
+				stats.leavesVisited,
+				stats.queriesCoalesced
+			);
+		}
+	}
+}
+
+/*
+ * times the vectorized distance kernels for one coordinate type against the original
+ * MinkowskiDistanceMetric implementation, which folds a temporary difference vector
+ */
+template<int N, typename TCoord, int NDims>
+void benchmarkDistanceKernel(const char* typeName) {
+
+	using DurNanos = std::chrono::duration<double, std::nano>;
+	using KernelType = iui::detail::MinkowskiKernel<N, TCoord>;
+
+	constexpr int NumVectors = 1024;
+	constexpr int NumRepeats = 64;
+
+	std::minstd_rand0 random {1};
+	std::vector<iui::Vec<TCoord, NDims>> vectors(NumVectors);
+	for(auto& vec: vectors) {
+		vec.forEach([&](TCoord& v) {
+			v = TCoord(random() % 256);
+		});
+	}
+
+	auto timePerCall = [&](auto&& distanceFn) {
+		double checksum = 0.0;
+		auto t0 = std::chrono::high_resolution_clock::now();
+		for(int repeat=0; repeat<NumRepeats; repeat++) {
+			for(int i=0; i+1<NumVectors; i++) {
+				checksum += distanceFn(vectors[i], vectors[i + 1]);
+			}
+		}
+		auto t1 = std::chrono::high_resolution_clock::now();
+		if(checksum < 0) {
+			printf("unreachable\n");
+		}
+		return DurNanos(t1 - t0).count() / (NumRepeats * (NumVectors - 1));
+	};
+
+	double nanosOriginal = timePerCall([](const auto& p1, const auto& p2) {
+		double result = 0.0;
+		(p2 - p1).forEach([&](auto v) {
+			result += iui::detail::constAbsPow<N>(v);
+		});
+		return result;
+	});
+	std::cout << std::format("L{} {:>7}[{}]: original {:.1f} ns", N, typeName, NDims, nanosOriginal);
+
+	for(auto level: {iui::SimdLevel::Scalar, iui::SimdLevel::SSE2, iui::SimdLevel::AVX2, iui::SimdLevel::AVX512}) {
+		if(level > iui::detail::supportedSimdLevel()) {
+			continue;
+		}
+		auto kernel = KernelType::forLevel(level);
+		double nanos = timePerCall([kernel](const auto& p1, const auto& p2) {
+			return kernel(&p1[0], &p2[0], NDims);
+		});
+		std::cout << std::format(", {} {:.1f} ns ({:.1f}x)", iui::simdLevelName(level), nanos, nanosOriginal / nanos);
+	}
+	std::cout << "\n";
+}
+
+/*
+ * times the kernels that are dispatched through iui::forceSimdLevel() instead of by function pointer
+ */
+void benchmarkDispatchedKernels() {
+
+	using DurNanos = std::chrono::duration<double, std::nano>;
+	using TMetric = iui::EuclideanDistanceMetric;
+	using TPCA = iui::PrincipalComponentAnalysis<float, 784, 72>;
+
+	constexpr int NumVectors = 1024;
+	constexpr int NumRepeats = 16;
+	constexpr int LeafSize = 32;
+
+	std::minstd_rand0 random {1};
+	std::vector<iui::Vec<float, 784>> vectors(NumVectors);
+	for(auto& vec: vectors) {
+		vec.forEach([&](float& v) {
+			v = float(random() % 256);
+		});
+	}
+	TPCA pca(vectors);
+
+	std::vector<float> soaCoords(784 * LeafSize);
+	for(auto& v: soaCoords) {
+		v = float(random() % 256);
+	}
+	std::vector<float> soaDistances(LeafSize);
+
+	iui::Hyperbox<float, 784> hbox;
+	for(int axis=0; axis<784; axis++) {
+		hbox.pos0[axis] = float(random() % 128);
+		hbox.pos1[axis] = hbox.pos0[axis] + 128.0f;
+	}
+
+	auto timePerCall = [&](auto&& fn) {
+		double checksum = 0.0;
+		auto t0 = std::chrono::high_resolution_clock::now();
+		for(int repeat=0; repeat<NumRepeats; repeat++) {
+			for(const auto& vec: vectors) {
+				checksum += fn(vec);
+			}
+		}
+		auto t1 = std::chrono::high_resolution_clock::now();
+		if(checksum < 0) {
+			printf("unreachable\n");
+		}
+		return DurNanos(t1 - t0).count() / (NumRepeats * NumVectors);
+	};
+
+	printf("benchmarking dispatched kernels (784 dims)...\n");
+	iui::SimdLevel initialLevel = iui::getSimdLevel();
+	for(auto level: {iui::SimdLevel::Scalar, iui::SimdLevel::SSE2, iui::SimdLevel::AVX2, iui::SimdLevel::AVX512}) {
+		if(iui::forceSimdLevel(level) != level) {
+			continue;
+		}
+		double nanosSoA = timePerCall([&](const auto& vec) {
+			TMetric::reducedDistancesSoA(vec, soaCoords.data(), LeafSize, LeafSize, soaDistances.data());
+			return double(soaDistances[0]);
+		});
+		double nanosHbox = timePerCall([&](const auto& vec) {
+			return double(TMetric::intersectsSearchSpaceReduced(hbox, vec, 1e6));
+		});
+		double nanosPCA = timePerCall([&](const auto& vec) {
+			return double(pca.reduce(vec)[0]);
+		});
+		std::cout << std::format(
+			"{:>7}: leaf scan ({} points) {:.1f} ns, hyperbox test {:.1f} ns, PCA projection to 72 dims {:.1f} ns\n",
+			iui::simdLevelName(level), LeafSize, nanosSoA, nanosHbox, nanosPCA
+		);
+	}
+	iui::forceSimdLevel(initialLevel);
+
+	/* the batched projection is a matrix product in Eigen, which does not follow the dispatched level */
+	std::vector<TPCA::OutputType> projected(vectors.size());
+	auto t0 = std::chrono::high_resolution_clock::now();
+	for(int repeat=0; repeat<NumRepeats; repeat++) {
+		pca.reduceBatch(vectors, projected);
+	}
+	auto t1 = std::chrono::high_resolution_clock::now();
+	std::cout << std::format(
+		"batched PCA projection to 72 dims {:.1f} ns per point\n",
+		DurNanos(t1 - t0).count() / (NumRepeats * NumVectors)
+	);
+}
+
+void benchmarkDistanceKernels() {
+	printf("benchmarking distance kernels...\n");
+	benchmarkDistanceKernel<1, float, 784>("float");
+	benchmarkDistanceKernel<2, float, 784>("float");
+	benchmarkDistanceKernel<1, int32_t, 784>("int32");
+	benchmarkDistanceKernel<2, int32_t, 784>("int32");
+	benchmarkDistanceKernel<1, uint8_t, 784>("uint8");
+	benchmarkDistanceKernel<2, uint8_t, 784>("uint8");
+}
+
+void benchmarkDynamicIndex() {
+
+	using DurMillis = std::chrono::duration<double, std::milli>;
+	using TDynamicClassifier = iui::KNNClassifier<iui::EuclideanDistanceMetric, int, float, 3, iui::NoDimensionalityReduction, 3, iui::DynamicKDTree>;
+	using TStaticClassifier = iui::KNNClassifier<iui::EuclideanDistanceMetric, int, float, 3>;
+
+	struct PaletteColor {
+		iui::Vec3f position;
+		int value;
+	};
+
+	std::minstd_rand0 random {1};
+	auto dist = std::uniform_real_distribution(0.0, 1.0);
+	auto randv3f = [&]() {
+		return iui::Vec3f(dist(random), dist(random), dist(random));
+	};
+
+	std::vector<PaletteColor> live;
+	for(int i=0; i<65536; i++) {
+		live.push_back({randv3f(), i});
+	}
+	TDynamicClassifier dynamicClassifier(live, {.seed = 1});
+
+	/* each round inserts 1024 entries, erases 512 and runs 4096 queries */
+	constexpr int NumRounds = 16;
+	double millisUpdates = 0.0, millisQueries = 0.0, millisRebuilds = 0.0, millisStaticQueries = 0.0;
+	int nextLabel = int(live.size());
+	for(int round=0; round<NumRounds; round++) {
+		auto t0 = std::chrono::high_resolution_clock::now();
+		for(int i=0; i<1024; i++) {
+			PaletteColor color {randv3f(), nextLabel++};
+			dynamicClassifier.insert(color.position, color.value);
+			live.push_back(color);
+		}
+		for(int i=0; i<512; i++) {
+			size_t index = random() % live.size();
+			(void)dynamicClassifier.erase(live[index].position, live[index].value);
+			live[index] = live.back();
+			live.pop_back();
+		}
+		auto t1 = std::chrono::high_resolution_clock::now();
+
+		std::vector<iui::Vec3f> queries;
+		for(int i=0; i<4096; i++) {
+			queries.push_back(randv3f());
+		}
+		int64_t checksum = 0;
+		for(const auto& query: queries) {
+			checksum += dynamicClassifier.predict(query, 1);
+		}
+		auto t2 = std::chrono::high_resolution_clock::now();
+
+		TStaticClassifier staticClassifier(live, {.seed = 1});
+		auto t3 = std::chrono::high_resolution_clock::now();
+		for(const auto& query: queries) {
+			checksum -= staticClassifier.predict(query, 1);
+		}
+		auto t4 = std::chrono::high_resolution_clock::now();
+
+		if(checksum != 0) {
+			std::cout << "dynamic index disagrees with a rebuilt static index\n";
+		}
+		millisUpdates += DurMillis(t1 - t0).count();
+		millisQueries += DurMillis(t2 - t1).count();
+		millisRebuilds += DurMillis(t3 - t2).count();
+		millisStaticQueries += DurMillis(t4 - t3).count();
+	}
+
+	std::cout << std::format(
+		"dynamic index, {} live entries in {} trees: {:.3f} us/update, {:.3f} us/query "
+		"(static rebuild: {:.2f} ms/round, {:.3f} us/query)\n",
+		dynamicClassifier.tree().numEntries(),
+		dynamicClassifier.tree().numTrees(),
+		1000.0 * millisUpdates / (NumRounds * 1536),
+		1000.0 * millisQueries / (NumRounds * 4096),
+		millisRebuilds / NumRounds,
+		1000.0 * millisStaticQueries / (NumRounds * 4096));
 }
 
 void simpleUsageExample(auto&& mnistTrain, auto&& mnistVal) {
-	iui::KNNClassifier<iui::EuclideanDistanceMetric, int, int, 784, iui::PrincipalComponentAnalysis, 12> classifier(mnistTrain);
+	using TClassifier = iui::KNNClassifier<iui::EuclideanDistanceMetric, int, int, 784, iui::PrincipalComponentAnalysis, 12>;
+	static constexpr const char* IndexFilename = "mnist_pca12.kdtree";
+
+	auto classifier = [&]() {
+		try {
+			auto loaded = TClassifier::load(IndexFilename);
+			std::cout << std::format("loaded index from {}\n", IndexFilename);
+			return loaded;
+		} catch(const iui::SerializationError& ex) {
+			std::cout << std::format("cannot load index ({}), building it\n", ex.what());
+			TClassifier built(mnistTrain);
+			built.save(IndexFilename);
+			return built;
+		}
+	}();
 
 	std::minstd_rand0 random {std::random_device{}()};
 	std::vector<NumberMNIST> sample;
@@ -125,17 +919,30 @@ void simpleUsageExample(auto&& mnistTrain, auto&& mnistVal) {
 
 int main()
 {
-	constexpr int bruh = sizeof(typename iui::KDTree<int, 3, float>::Node);
 	printf("reading MNIST dataset...\n");
 	auto mnistTrain = readSampleFileMNIST("trainingsample.csv");
 	auto mnistVal = readSampleFileMNIST("validationsample.csv");
 
 	simpleUsageExample(mnistTrain, mnistVal);
 
+	benchmarkDistanceKernels();
+	benchmarkDispatchedKernels();
+
 	benchmarkPaletteQuantization();
+	benchmarkCoalescedBatch();
+	benchmarkDynamicIndex();
 
-	benchmarkEuclidean(mnistTrain, mnistVal);
-	benchmarkManhattan(mnistTrain, mnistVal);
+	benchmarkPCAFit(mnistTrain, mnistVal);
+	benchmarkRandomProjection(mnistTrain, mnistVal);
+	auto pcaModel = fitMNISTPCAModel(mnistTrain);
+	benchmarkEuclidean(mnistTrain, mnistVal, pcaModel);
+	benchmarkReranking(mnistTrain, mnistVal, pcaModel);
+	benchmarkNodeBounds(mnistTrain, mnistVal);
+	benchmarkSplitPolicies(mnistTrain, mnistVal);
+	benchmarkEntryOrder(mnistTrain, mnistVal);
+	benchmarkApproximateSearch(mnistTrain, mnistVal);
+	benchmarkForest(mnistTrain, mnistVal);
+	benchmarkManhattan(mnistTrain, mnistVal, pcaModel);
 
 	return 0;
 }